@@ -34,6 +34,11 @@
 #include <dirent.h>
 #include <sys/utsname.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -82,16 +87,130 @@ static unsigned int skipchars; /* prefix target part of basedir to skip over */
 static unsigned int make_map_files = 1; /* default to on */
 static unsigned int force_map_files = 0; /* default to on */
 
-#define SYMBOL_HASH_SIZE 1024
+/*
+ * Statistics (depmod --stats)
+ *
+ * With --stats, depmod says where its time went as it finishes: a
+ * "phase" line for each phase, giving how many times it ran, the wall
+ * and CPU seconds taken and the bytes read or written (where that means
+ * anything), then a "counts" line.  They go to stderr as space separated
+ * key=value pairs, so that they are easy to pick apart.
+ *
+ * Phases which run once are timed on the process CPU clock, so they
+ * include any threads they start.  Those which run for each module or
+ * output file, possibly several at once, use the thread's CPU clock and
+ * are added up, so their wall time can be more than actually elapsed.
+ */
+enum stats_phase_id
+{
+	STATS_TOTAL,
+	STATS_SCAN,
+	STATS_READ,
+	STATS_LOAD,
+	STATS_DECOMPRESS,
+	STATS_PARSE,
+	STATS_DEPS,
+	STATS_LOOPS,
+	NUM_STATS_PHASES
+};
+
+static const char *stats_phase_names[NUM_STATS_PHASES] = {
+	"total", "scan", "read", "load", "decompress", "parse", "deps",
+	"loops",
+};
+
+struct stats_phase
+{
+	unsigned long calls;
+	uint64_t wall_ns, cpu_ns, bytes;
+};
+
+struct stats_timer
+{
+	clockid_t clock;
+	struct timespec wall, cpu;
+};
+
+static int show_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_phase stats_phases[NUM_STATS_PHASES];
+
+/* Only counted by the main thread */
+static struct {
+	unsigned long cached, symbols, lookups;
+} stats;
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void stats_start(struct stats_timer *t, int per_thread)
+{
+	if (!show_stats)
+		return;
+	t->clock = per_thread ? CLOCK_THREAD_CPUTIME_ID
+			      : CLOCK_PROCESS_CPUTIME_ID;
+	clock_gettime(CLOCK_MONOTONIC, &t->wall);
+	clock_gettime(t->clock, &t->cpu);
+}
+
+static void stats_add(struct stats_timer *t, struct stats_phase *phase,
+		      uint64_t bytes)
+{
+	struct timespec wall, cpu;
+
+	if (!show_stats)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(t->clock, &cpu);
+
+	pthread_mutex_lock(&stats_lock);
+	phase->calls++;
+	phase->wall_ns += timespec_ns(&wall) - timespec_ns(&t->wall);
+	phase->cpu_ns += timespec_ns(&cpu) - timespec_ns(&t->cpu);
+	phase->bytes += bytes;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_stop(struct stats_timer *t, enum stats_phase_id id,
+		       uint64_t bytes)
+{
+	stats_add(t, &stats_phases[id], bytes);
+}
+
+static void print_stats_phase(const char *name,
+			      const struct stats_phase *phase)
+{
+	fprintf(stderr, "phase name=%s calls=%lu wall=%.6f cpu=%.6f "
+		"bytes=%llu\n", name, phase->calls, phase->wall_ns / 1e9,
+		phase->cpu_ns / 1e9, (unsigned long long)phase->bytes);
+}
+
 struct symbol
 {
-	struct symbol *next;
 	struct module *owner;
 	uint64_t ver;
-	char name[0];
+	const char *name;
+	unsigned int hash;	/* tdb_hash(name) */
 };
 
-static struct symbol *symbolhash[SYMBOL_HASH_SIZE];
+/* Every symbol added, oldest first */
+static struct symbol *symbols;
+static unsigned int num_symbols, max_symbols;
+
+/*
+ * Open addressing hash of symbol names: each slot holds the index + 1 of
+ * the newest symbol of that name, or 0 if empty.  Never more than half
+ * full, so probe sequences stay short.
+ */
+static unsigned int *symbol_table;
+static unsigned int symbol_table_size, num_symbol_names;
+
+/* Symbol names are copied into big blocks rather than malloced one by one */
+#define SYMBOL_NAME_BLOCK 65536
+static char *symbol_names;
+static size_t symbol_names_left;
 
 /**
  * tdb_hash - calculate hash entry for a symbol (algorithm from gdbm, via tdb)
@@ -111,6 +230,55 @@ static inline unsigned int tdb_hash(const char *name)
 	return (1103515243 * value + 12345);
 }
 
+static const char *copy_symbol_name(const char *name)
+{
+	size_t len = strlen(name) + 1;
+	char *copy;
+
+	if (len > SYMBOL_NAME_BLOCK)
+		return NOFAIL(strdup(name));
+	if (len > symbol_names_left) {
+		symbol_names = NOFAIL(malloc(SYMBOL_NAME_BLOCK));
+		symbol_names_left = SYMBOL_NAME_BLOCK;
+	}
+	copy = memcpy(symbol_names, name, len);
+	symbol_names += len;
+	symbol_names_left -= len;
+	return copy;
+}
+
+/* The slot for a name: where it is, or the empty slot it would go in */
+static unsigned int *symbol_slot(const char *name, unsigned int hash)
+{
+	unsigned int mask = symbol_table_size - 1;
+	unsigned int i = (hash ^ (hash >> 16)) & mask;
+
+	while (symbol_table[i]) {
+		const struct symbol *s = &symbols[symbol_table[i] - 1];
+
+		if (s->hash == hash && streq(s->name, name))
+			break;
+		i = (i + 1) & mask;
+	}
+	return &symbol_table[i];
+}
+
+static void grow_symbol_table(void)
+{
+	unsigned int *old = symbol_table, old_size = symbol_table_size, i;
+
+	symbol_table_size = old_size ? old_size * 2 : 1024;
+	symbol_table = NOFAIL(calloc(symbol_table_size, sizeof(*symbol_table)));
+	for (i = 0; i < old_size; i++) {
+		if (old[i]) {
+			const struct symbol *s = &symbols[old[i] - 1];
+
+			*symbol_slot(s->name, s->hash) = old[i];
+		}
+	}
+	free(old);
+}
+
 /**
  * skip_symprefix - remove extraneous prefix character on some architectures
  *
@@ -132,16 +300,30 @@ static const char *skip_symprefix(const char *symname)
  */
 static void add_symbol(const char *name, uint64_t ver, struct module *owner)
 {
-	unsigned int hash;
-	struct symbol *new = NOFAIL(malloc(sizeof *new + strlen(name) + 1));
-
+	unsigned int hash = tdb_hash(name);
+	unsigned int *slot;
+	struct symbol *new;
+
+	if ((num_symbol_names + 1) * 2 > symbol_table_size)
+		grow_symbol_table();
+	slot = symbol_slot(name, hash);
+
+	if (num_symbols == max_symbols) {
+		max_symbols = max_symbols ? max_symbols * 2 : 1024;
+		symbols = NOFAIL(realloc(symbols,
+					 max_symbols * sizeof(*symbols)));
+	}
+	new = &symbols[num_symbols++];
 	new->owner = owner;
 	new->ver = ver;
-	strcpy(new->name, name);
-
-	hash = tdb_hash(name) % SYMBOL_HASH_SIZE;
-	new->next = symbolhash[hash];
-	symbolhash[hash] = new;
+	new->hash = hash;
+	if (*slot)
+		new->name = symbols[*slot - 1].name;	/* share the name */
+	else {
+		new->name = copy_symbol_name(name);
+		num_symbol_names++;
+	}
+	*slot = num_symbols;
 }
 
 static int print_unknown, check_symvers;
@@ -156,22 +338,24 @@ static int print_unknown, check_symvers;
  *
  * This function is used during dependency calculation to match the
  * dependencies a module says it requires with symbols we have seen.
- * calculate_deps calls us after it has load_dep_syms on a module.
+ * calculate_deps calls us for each symbol read_module found it needs.
  *
  */
 static struct module *find_symbol(const char *name, uint64_t ver,
 		const char *modname, int weak)
 {
-	struct symbol *s;
+	struct symbol *s = NULL;
+	unsigned int slot;
 
 	/* For our purposes, .foo matches foo.  PPC64 needs this. */
 	if (name[0] == '.')
 		name++;
 	name = skip_symprefix(name);
 
-	for (s = symbolhash[tdb_hash(name) % SYMBOL_HASH_SIZE]; s; s=s->next) {
-		if (streq(s->name, name))
-			break;
+	if (symbol_table_size) {
+		slot = *symbol_slot(name, tdb_hash(name));
+		if (slot)
+			s = &symbols[slot - 1];
 	}
 	if (s) {
 		if (ver && s->ver && s->ver != ver && print_unknown && !weak)
@@ -313,6 +497,11 @@ static const struct option options[] = { { "all", 0, NULL, 'a' },
 				   { "version", 0, NULL, 'V' },
 				   { "warn", 0, NULL, 'w' },
 				   { "map", 0, NULL, 'm' },
+				   { "incremental", 0, NULL, 'i' },
+				   { "jobs", 1, NULL, 'j' },
+				   { "rebuild-cache", 0, NULL, 'R' },
+				   { "watch", 0, NULL, 'W' },
+				   { "stats", 0, NULL, 'S' },
 				   { NULL, 0, NULL, 0 } };
 
 /**
@@ -363,9 +552,9 @@ static void print_usage(const char *name)
 {
 	fprintf(stderr,
 	"%s " VERSION " -- part of " PACKAGE "\n"
-	"%s -[aA] [-n -e -v -q -V -r -u -w -m]\n"
+	"%s -[aA] [-n -e -v -q -V -r -u -w -m -R -W -S] [-j jobs]\n"
 	"      [-b basedirectory] [forced_version]\n"
-	"depmod [-n -e -v -q -r -u -w] [-F kernelsyms] module1.ko module2.ko ...\n"
+	"depmod [-n -e -v -q -r -u -w -i] [-F kernelsyms] module1.ko module2.ko ...\n"
 	"If no arguments (except options) are given, \"depmod -a\" is assumed\n"
 	"\n"
 	"depmod will output a dependancy list suitable for the modprobe utility.\n"
@@ -375,9 +564,14 @@ static void print_usage(const char *name)
 	"\t-a, --all            Probe all modules\n"
 	"\t-A, --quick          Only does the work if there's a new module\n"
 	"\t-e, --errsyms        Report not supplied symbols\n"
+	"\t-i, --incremental    Update the output files for the given modules\n"
+	"\t-j, --jobs N         Use N threads (default: one per CPU)\n"
 	"\t-m, --map            Create the legacy map files\n"
 	"\t-n, --show           Write the dependency file on stdout only\n"
 	"\t-P, --symbol-prefix  Architecture symbol prefix\n"
+	"\t-R, --rebuild-cache  Read every module, not just those changed\n"
+	"\t-S, --stats          Report time taken and work done, on stderr\n"
+	"\t-W, --watch          Keep running, rebuilding as modules change\n"
 	"\t-V, --version        Print the release version\n"
 	"\t-v, --verbose        Enable verbose mode\n"
 	"\t-w, --warn		Warn on duplicates\n"
@@ -418,17 +612,17 @@ static int ends_in(const char *name, const char *ext)
 }
 
 /**
- * grab_module - open module ELF file and load symbol data
+ * new_module - allocate a module, not yet read
  *
  * @dirname:	path prefix
  * @filename:	filename within path
  *
  */
-static struct module *grab_module(const char *dirname, const char *filename)
+static struct module *new_module(const char *dirname, const char *filename)
 {
 	struct module *new;
 
-	new = NOFAIL(malloc(sizeof(*new)
+	new = NOFAIL(calloc(1, sizeof(*new)
 			    + strlen(dirname?:"") + 1 + strlen(filename) + 1));
 	if (dirname)
 		sprintf(new->pathname, "%s/%s", dirname, filename);
@@ -436,10 +630,53 @@ static struct module *grab_module(const char *dirname, const char *filename)
 		strcpy(new->pathname, filename);
 	new->basename = my_basename(new->pathname);
 
-	INIT_LIST_HEAD(&new->dep_list);
 	new->order = INDEX_PRIORITY_MIN;
+	return new;
+}
+
+/* Note which version of the module's file is being used, for the cache */
+static void set_module_stat(struct module *module, const struct stat *st)
+{
+	module->ino = st->st_ino;
+	module->size = st->st_size;
+	module->mtime = st->st_mtim.tv_sec;
+	module->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ * grab_elf_file, timed as a load or, if compressed, a decompression.
+ * The file is stat()ed first: if it is replaced while being read, the
+ * cache then records the old file, and the next run reads it again.
+ */
+static struct elf_file *load_elf_file(struct module *module)
+{
+	struct elf_file *file;
+	struct stats_timer t;
+	struct stat st;
+
+	if (stat(module->pathname, &st) != 0)
+		return NULL;
+	set_module_stat(module, &st);
+
+	stats_start(&t, 1);
+	file = grab_elf_file(module->pathname);
+	stats_stop(&t, ends_in(module->pathname, ".gz")
+		   ? STATS_DECOMPRESS : STATS_LOAD, file ? file->len : 0);
+	return file;
+}
 
-	new->file = grab_elf_file(new->pathname);
+/**
+ * grab_module - open module ELF file and load symbol data
+ *
+ * @dirname:	path prefix
+ * @filename:	filename within path
+ *
+ */
+static struct module *grab_module(const char *dirname, const char *filename)
+{
+	struct module *new = new_module(dirname, filename);
+
+	new->file = load_elf_file(new);
 	if (!new->file) {
 		warn("Can't read module %s: %s\n",
 		     new->pathname, strerror(errno));
@@ -449,114 +686,255 @@ static struct module *grab_module(const char *dirname, const char *filename)
 	return new;
 }
 
-/* We use this on-stack structure to track recursive calls to has_dep_loop */
-struct module_traverse
-{
-	struct module_traverse *prev;
-	struct module *mod;
-};
-
 /**
- * in_loop - determine if a module dependency loop exists
+ * parse_modinfo - pick out what the output functions want from the strings
  *
- * @mod:	current module
- * @traverse:	on-stack structure created as module deps were processed
+ * @module:	module, read or taken from the cache
+ *
+ * So that each output needn't go through every .modinfo string again.
  *
  */
-static int in_loop(struct module *mod, const struct module_traverse *traverse)
+static void parse_modinfo(struct module *module)
 {
-	const struct module_traverse *i;
+	struct module_info *info = &module->info;
+	struct string_table *tbl;
+	unsigned int j, maj, min;
+	const char *devname = NULL;
+	char type = '\0';
+
+	info->modname = NOFAIL(malloc(strlen(module->pathname) + 1));
+	filename2modname(info->modname, module->pathname);
+
+	/* Old-style .modalias section, then new-style .modinfo section. */
+	tbl = module->modalias;
+	for (j = 0; tbl && j < tbl->cnt; j++)
+		info->aliases = NOFAIL(strtbl_add(tbl->str[j], info->aliases));
+
+	tbl = module->modinfo;
+	for (j = 0; tbl && j < tbl->cnt; j++) {
+		const char *p = tbl->str[j];
+
+		if (strstarts(p, "alias="))
+			info->aliases = NOFAIL(strtbl_add(p + strlen("alias="),
+							  info->aliases));
+		else if (strstarts(p, "softdep="))
+			info->softdeps = NOFAIL(strtbl_add(p + strlen("softdep="),
+							   info->softdeps));
+	}
 
-	for (i = traverse; i; i = i->prev) {
-		if (i->mod == mod)
-			return 1;
+	/* The first devname, with the last device number before it */
+	for (j = 0; tbl && j < tbl->cnt; j++) {
+		const char *p = tbl->str[j];
+
+		if (sscanf(p, "alias=char-major-%u-%u", &maj, &min) == 2)
+			type = 'c';
+		else if (sscanf(p, "alias=block-major-%u-%u", &maj, &min) == 2)
+			type = 'b';
+		else if (strstarts(p, "alias=devname:"))
+			devname = &p[strlen("alias=devname:")];
+
+		if (type && devname) {
+			info->devname = devname;
+			info->devtype = type;
+			info->major = maj;
+			info->minor = min;
+			break;
+		}
 	}
-	return 0;
 }
 
 /**
- * report_loop - report (once) that a dependency loop exists for a module
+ * loop_path - find a way round a dependency loop
+ *
+ * @mod:	module reached so far
+ * @start:	module the loop is reported from
  *
- * @mod:	module with dep loop
- * @traverse:	on-stack structure created as module deps were processed
+ * Follows dependencies within @start's component, in order, the way
+ * depmod always has, marking each module with the one it was reached
+ * from.  Returns the module which needs @start again, or NULL.
  *
  */
-static void report_loop(const struct module *mod,
-			const struct module_traverse *traverse)
+static struct module *loop_path(struct module *mod, struct module *start)
 {
-	const struct module_traverse *i;
+	struct module *last;
+	unsigned int i;
 
-	/* Check that start is least alphabetically.  eg.  a depends
-	   on b depends on a will get reported for a, not b.  */
-	for (i = traverse->prev; i->prev; i = i->prev) {
-		if (strcmp(mod->pathname, i->mod->pathname) > 0)
-			return;
+	for (i = 0; i < mod->num_deps; i++) {
+		struct module *dep = mod->deps[i];
+
+		if (dep == start)
+			return mod;
+		if (dep->loop_scc != start->loop_scc || dep->loop_parent)
+			continue;
+		dep->loop_parent = mod;
+		last = loop_path(dep, start);
+		if (last)
+			return last;
 	}
+	return NULL;
+}
 
-	/* Is start in the loop?  If not, don't report now. eg. a
-	   depends on b which depends on c which depends on b.  Don't
-	   report when generating depends for a. */
-	if (mod != i->mod)
-		return;
+/**
+ * report_loop - report a dependency loop
+ *
+ * @start:	module in the loop, marked by find_loops()
+ *
+ * The loop is printed backwards from the module which needs @start.
+ *
+ */
+static void report_loop(struct module *start)
+{
+	struct module *mod;
 
-	warn("Loop detected: %s ", mod->pathname);
-	for (i = traverse->prev; i->prev; i = i->prev)
-		fprintf(stderr, "needs %s ", i->mod->basename);
-	fprintf(stderr, "which needs %s again!\n", i->mod->basename);
+	warn("Loop detected: %s ", start->pathname);
+	for (mod = loop_path(start, start); mod != start; mod = mod->loop_parent)
+		fprintf(stderr, "needs %s ", mod->basename);
+	fprintf(stderr, "which needs %s again!\n", start->basename);
 }
 
+/* State for find_loops() */
+struct loop_search
+{
+	unsigned int index;
+	struct module *stack;
+};
+
 /**
- * has_dep_loop - iterate over all module deps and check for loops
+ * find_loops - find the modules which need modules in dependency loops
  *
- * @module:	module to process
- * @prev:	previously processed dependency
- *
- * This function is called recursively, following every dep and creating
- * a module_traverse on the stack describing each dependency encountered.
- * Determining a loop is as simple (and slow) as finding repetitions.
+ * @mod:	module not yet visited
+ * @search:	search state
  *
- * This is slow, but we can't leave the user without any modules, so we
- * need to detect loops and just fail those modules that cause loops.
+ * This is Tarjan's strongly connected components algorithm, which finds
+ * every loop with a single visit to each module and dependency.  The
+ * components come out after those they depend on, so we can tell whether
+ * each one needs a loop as we go.  Every module in a component with more
+ * than one member (or depending on itself) is in a loop; that with the
+ * least pathname is marked for the loop to be reported from.
  *
  */
-static int has_dep_loop(struct module *module, struct module_traverse *prev)
+static void find_loops(struct module *mod, struct loop_search *search)
 {
+	struct module *scc, *m, *least;
 	unsigned int i;
-	struct module_traverse traverse = { .prev = prev, .mod = module };
+	int cyclic, in_loop = 0;
 
-	if (in_loop(module, prev)) {
-		report_loop(module, &traverse);
-		return 1;
+	mod->loop_index = mod->loop_low = ++search->index;
+	mod->loop_stack = search->stack;
+	search->stack = mod;
+	mod->on_loop_stack = 1;
+
+	for (i = 0; i < mod->num_deps; i++) {
+		struct module *dep = mod->deps[i];
+
+		if (!dep->loop_index) {
+			find_loops(dep, search);
+			if (dep->loop_low < mod->loop_low)
+				mod->loop_low = dep->loop_low;
+		} else if (dep->on_loop_stack
+			   && dep->loop_index < mod->loop_low)
+			mod->loop_low = dep->loop_index;
 	}
+	if (mod->loop_low != mod->loop_index)
+		return;
 
-	for (i = 0; i < module->num_deps; i++)
-		if (has_dep_loop(module->deps[i], &traverse))
-			return 1;
-	return 0;
+	/* Pop mod and those above it on the stack: they are a component */
+	scc = search->stack;
+	search->stack = mod->loop_stack;
+	mod->loop_stack = NULL;
+
+	cyclic = (scc != mod);
+	least = mod;
+	for (m = scc; m; m = m->loop_stack) {
+		m->loop_scc = mod;
+		m->on_loop_stack = 0;
+		if (strcmp(m->pathname, least->pathname) < 0)
+			least = m;
+	}
+	for (m = scc; m; m = m->loop_stack) {
+		for (i = 0; i < m->num_deps; i++) {
+			if (m->deps[i] == m)
+				cyclic = 1;
+			else if (m->deps[i]->loop_scc != mod)
+				in_loop |= m->deps[i]->in_loop;
+		}
+	}
+	for (m = scc; m; m = m->loop_stack)
+		m->in_loop = cyclic || in_loop;
+	least->report_loop = cyclic;
 }
 
 /**
  * order_dep_list - expand all module deps recursively and in order
  *
- * @start:	module being processed
- * @mod:	recursive dep
+ * @mod:	module being processed
+ * @seen:	scratch array, indexed by module id
  *
  * We expand all of the dependencies of the dependencies of a module
- * and ensure that the lowest dependency is loaded first, etc.
+ * and ensure that the lowest dependency is loaded first, etc.  Each
+ * dependency is followed by its own expanded list, keeping only the last
+ * of any repeats: ie. if a needs b and c, and c needs b, we must order b
+ * after c.  The dependencies' lists are done first and reused, so each
+ * module's list is only worked out once.
  *
  */
-static void order_dep_list(struct module *start, struct module *mod)
+static void order_dep_list(struct module *mod, unsigned int *seen)
 {
-	unsigned int i;
+	unsigned int i, j, n = 0, max = 0;
+	struct module **all;
+
+	if (mod->all_deps)
+		return;
 
 	for (i = 0; i < mod->num_deps; i++) {
-		/* If it was previously depended on, move it to the
-		   tail.  ie. if a needs b and c, and c needs b, we
-		   must order b after c. */
-		list_del(&mod->deps[i]->dep_list);
-		list_add_tail(&mod->deps[i]->dep_list, &start->dep_list);
-		order_dep_list(start, mod->deps[i]);
+		order_dep_list(mod->deps[i], seen);
+		max += 1 + mod->deps[i]->num_all_deps;
+	}
+	all = NOFAIL(malloc((max ?: 1) * sizeof(*all)));
+
+	/* Going backwards, the first of each is the one to keep */
+	for (i = mod->num_deps; i-- > 0; ) {
+		struct module *dep = mod->deps[i];
+
+		for (j = dep->num_all_deps; j-- > 0; ) {
+			if (seen[dep->all_deps[j]->id] != mod->id + 1) {
+				seen[dep->all_deps[j]->id] = mod->id + 1;
+				all[n++] = dep->all_deps[j];
+			}
+		}
+		if (seen[dep->id] != mod->id + 1) {
+			seen[dep->id] = mod->id + 1;
+			all[n++] = dep;
+		}
 	}
+
+	for (i = 0; i < n / 2; i++) {
+		struct module *tmp = all[i];
+
+		all[i] = all[n - 1 - i];
+		all[n - 1 - i] = tmp;
+	}
+	mod->all_deps = all;
+	mod->num_all_deps = n;
+}
+
+/**
+ * order_deps - work out the full dependency list of every module
+ *
+ * @list:	module list, without dependency loops
+ *
+ */
+static void order_deps(struct module *list)
+{
+	struct module *i;
+	unsigned int count = 0, *seen;
+
+	for (i = list; i; i = i->next)
+		i->id = count++;
+	seen = NOFAIL(calloc(count ?: 1, sizeof(*seen)));
+	for (i = list; i; i = i->next)
+		order_dep_list(i, seen);
+	free(seen);
 }
 
 static struct module *deleted = NULL;
@@ -585,6 +963,32 @@ static void del_module(struct module **modules, struct module *delme)
 	deleted = delme;
 }
 
+/**
+ * free_module - free a module read by read_module() which isn't wanted
+ *
+ * @mod:	module, on no list and depended on by no other module
+ *
+ */
+static void free_module(struct module *mod)
+{
+	if (mod->file)
+		release_elf_file(mod->file);
+	strtbl_free(mod->exports);
+	free(mod->export_vers);
+	strtbl_free(mod->dep_syms);
+	strtbl_free(mod->dep_types);
+	free(mod->dep_vers);
+	strtbl_free(mod->modalias);
+	strtbl_free(mod->modinfo);
+	free(mod->data);
+	free(mod->info.modname);
+	strtbl_free(mod->info.aliases);
+	strtbl_free(mod->info.softdeps);
+	free(mod->deps);
+	free(mod->all_deps);
+	free(mod);
+}
+
 /**
  * compress_path - strip out common path prefix for modules
  *
@@ -617,19 +1021,14 @@ static int output_deps(struct module *modules,
 			FILE *out, char *dirname)
 {
 	struct module *i;
+	unsigned int j;
 
 	for (i = modules; i; i = i->next) {
-		struct list_head *j, *tmp;
-		order_dep_list(i, i);
-
 		fprintf(out, "%s:", compress_path(i->pathname, dirname));
-		list_for_each_safe(j, tmp, &i->dep_list) {
-			struct module *dep
-				= list_entry(j, struct module, dep_list);
+		for (j = 0; j < i->num_all_deps; j++)
 			fprintf(out, " %s",
-			        compress_path(dep->pathname, dirname));
-			list_del_init(j);
-		}
+			        compress_path(i->all_deps[j]->pathname,
+					      dirname));
 		fprintf(out, "\n");
 	}
 	return 1;
@@ -646,7 +1045,8 @@ static int warn_dups = 0;
  * @dirname:	output directory
  *
  * This optimized dependency file contains an ordered structure that is
- * more easily processed by modprobe in a time sensitive manner.
+ * more easily processed by modprobe in a time sensitive manner.  Module
+ * names are only ever looked up exactly, so they are hashed as well.
  *
  */
 static int output_deps_bin(struct module *modules,
@@ -654,37 +1054,34 @@ static int output_deps_bin(struct module *modules,
 {
 	struct module *i;
 	struct index_node *index;
+	unsigned int j;
 	char *line;
 	char *p;
 
 	index = index_create();
 
 	for (i = modules; i; i = i->next) {
-		struct list_head *j, *tmp;
 		char modname[strlen(i->pathname)+1];
-		
-		order_dep_list(i, i);
+		size_t len;
 		
 		filename2modname(modname, i->pathname);
-		nofail_asprintf(&line, "%s:",
-		                compress_path(i->pathname, dirname));
-		p = line;
-		list_for_each_safe(j, tmp, &i->dep_list) {
-			struct module *dep
-				= list_entry(j, struct module, dep_list);
-			nofail_asprintf(&line, "%s %s",
-			                p,
-			                compress_path(dep->pathname, dirname));
-			free(p);
-			p = line;
-			list_del_init(j);
-		}
+		len = strlen(compress_path(i->pathname, dirname)) + 2;
+		for (j = 0; j < i->num_all_deps; j++)
+			len += 1 + strlen(compress_path(i->all_deps[j]->pathname,
+							dirname));
+		line = NOFAIL(malloc(len));
+		p = line + sprintf(line, "%s:",
+				   compress_path(i->pathname, dirname));
+		for (j = 0; j < i->num_all_deps; j++)
+			p += sprintf(p, " %s",
+				     compress_path(i->all_deps[j]->pathname,
+						   dirname));
 		if (index_insert(index, modname, line, i->order) && warn_dups)
 			warn("duplicate module deps:\n%s\n",line);
 		free(line);
 	}
 	
-	index_write(index, out);
+	index_write_hashed(index, out);
 	index_destroy(index);
 
 	return 1;
@@ -701,734 +1098,3437 @@ static int smells_like_module(const char *name)
 	return ends_in(name,".ko") || ends_in(name, ".ko.gz");
 }
 
-typedef struct module *(*do_module_t)(const char *dirname,
-				      const char *filename,
-				      struct module *next,
-				      struct module_search *search,
-				      struct module_overrides *overrides);
-
-/**
- * is_higher_priority - find modules replacing other modules
- *
- * @newpath:	new module path
- * @oldpath:	old module path
- * @search:	path search order
- * @overrides:	module override directives
- *
- * Compares one module (path) to another module (path) and determines
- * whether the new module should replace the existing module of the
- * same name. Overriding is handled very coarsely for the moment.
- *
+/*
+ * Strings (module basenames or paths) hashed to the position of their
+ * module in some array, to save walking the module list for each one.
  */
-static int is_higher_priority(const char *newpath, const char *oldpath,
-			      struct module_search *search,
-			      struct module_overrides *overrides)
+struct module_hash
 {
-	struct module_search *tmp;
-	struct module_overrides *ovtmp;
-	int i = 0;
-	int prio_builtin = -1;
-	int prio_new = -1;
-	int prio_old = -1;
+	unsigned int size, count;
+	struct module_hash_entry {
+		const char *key;
+		unsigned int hash;
+		unsigned int n;		/* array index + 1, or 0 if unused */
+	} *entries;
+};
 
-/* The names already match, now we check for overrides and directory search
- * order
- */
-	for (ovtmp = overrides; ovtmp != NULL; ovtmp = ovtmp->next) {
-		if (streq(ovtmp->modfile, newpath))
-			return 1;
-		if (streq(ovtmp->modfile, oldpath))
-			return 0;
-	}
-	for (i = 0, tmp = search; tmp != NULL; tmp = tmp->next, i++) {
-		if (streq(tmp->search_path, MODULE_BUILTIN_KEY))
-			prio_builtin = i;
-		else if (strncmp(tmp->search_path, newpath, tmp->len) == 0)
-			prio_new = i;
-		else if (strncmp(tmp->search_path, oldpath, tmp->len) == 0)
-			prio_old = i;
-	}
-	if (prio_new < 0)
-		prio_new = prio_builtin;
-	if (prio_old < 0)
-		prio_old = prio_builtin;
+/* Find the entry for key, or the unused one it should go in */
+static struct module_hash_entry *module_hash_find(struct module_hash *h,
+						  const char *key)
+{
+	unsigned int hash = tdb_hash(key), mask = h->size - 1;
+	unsigned int i = (hash ^ (hash >> 16)) & mask;
 
-	return prio_new > prio_old;
+	while (h->entries[i].n) {
+		if (h->entries[i].hash == hash && streq(h->entries[i].key, key))
+			break;
+		i = (i + 1) & mask;
+	}
+	h->entries[i].hash = hash;
+	return &h->entries[i];
 }
 
 /**
- * do_module - process a module file
+ * module_hash_add - add a string, unless it's there already
  *
- * @dirname:	directory containing module
- * @filename:	module disk file
- * @list:	list of modules
- * @search:	path search order
- * @overrides:	module override directives
+ * @h:		hash
+ * @key:	string, which must stay around as long as the hash does
+ * @n:		array index + 1 to give it
+ *
+ * Returns the entry for the string; the caller can tell whether it was
+ * already there from whether the entry's n is @n.
  *
  */
-static struct module *do_module(const char *dirname,
-				       const char *filename,
-				       struct module *list,
-				       struct module_search *search,
-				       struct module_overrides *overrides)
+static struct module_hash_entry *module_hash_add(struct module_hash *h,
+						 const char *key,
+						 unsigned int n)
 {
-	struct module *new, **i;
-
-	new = grab_module(dirname, filename);
-	if (!new)
-		return list;
+	struct module_hash_entry *e;
+
+	if ((h->count + 1) * 2 > h->size) {
+		struct module_hash_entry *old = h->entries;
+		unsigned int i, old_size = h->size;
+
+		h->size = old_size ? old_size * 2 : 256;
+		h->entries = NOFAIL(calloc(h->size, sizeof(*h->entries)));
+		for (i = 0; i < old_size; i++)
+			if (old[i].n)
+				*module_hash_find(h, old[i].key) = old[i];
+		free(old);
+	}
 
-	/* Check if module is already in the list. */
-	for (i = &list; *i; i = &(*i)->next) {
+	e = module_hash_find(h, key);
+	if (!e->n) {
+		e->key = key;
+		e->n = n;
+		h->count++;
+	}
+	return e;
+}
 
-		if (streq((*i)->basename, filename)) {
-			char newpath[strlen(dirname) + strlen("/")
-				      + strlen(filename) + 1];
+/* A module's device tables, to go through them in turn */
+#define NUM_TABLES 9
 
-			sprintf(newpath, "%s/%s", dirname, filename);
+struct table_ref
+{
+	void **table;
+	unsigned int *size;		/* of an entry */
+	unsigned int *table_size;
+};
 
-			/* if module matches an existing entry (name) but */
-			/* has a higher priority, replace existing entry. */
-			if (is_higher_priority(newpath, (*i)->pathname,search,
-					       overrides)) {
-				del_module(i, *i);
-				
-				new->next = *i;
-				*i = new;
-			} else
-				del_module(NULL, new);
+static void get_table_refs(struct module_tables *t, struct table_ref *refs)
+{
+	struct table_ref r[NUM_TABLES] = {
+		{ &t->pci_table, &t->pci_size, &t->pci_table_size },
+		{ &t->usb_table, &t->usb_size, &t->usb_table_size },
+		{ &t->ieee1394_table, &t->ieee1394_size,
+		  &t->ieee1394_table_size },
+		{ &t->ccw_table, &t->ccw_size, &t->ccw_table_size },
+		{ &t->pnp_table, &t->pnp_size, &t->pnp_table_size },
+		{ &t->pnp_card_table, &t->pnp_card_size,
+		  &t->pnp_card_table_size },
+		{ &t->input_table, &t->input_size, &t->input_table_size },
+		{ &t->serio_table, &t->serio_size, &t->serio_table_size },
+		{ &t->of_table, &t->of_size, &t->of_table_size },
+	};
+
+	memcpy(refs, r, sizeof(r));
+}
 
-			return list;
-		}
-	}
+#define ALIGN8(len) (((len) + 7) & ~(size_t)7)
 
-	/* Not in the list already. Just prepend. */
-	new->next = list;
-	return new;
+/*
+ * Room for a copy of a table.  Tables are scanned up to an empty entry,
+ * so a couple of empty ones go after it in case the module's was cut
+ * short.
+ */
+static size_t table_copy_len(unsigned int size, unsigned int table_size)
+{
+	return ALIGN8(table_size) + ALIGN8(2 * size);
 }
 
-/**
- * grab_dir - process a directory of modules
+/*
+ * modules.cache keeps what read_module() found in each module, so that a
+ * later run need only read the modules which have changed since.  Only
+ * depmod itself reads it, so it is just written out in host order:
  *
- * @dirname:	directory name
- * @dir:	open directory reference
- * @do_mod:	do_module function to use
- * @search:	path search order
- * @overrides:	module overrides directives
+ *	struct cache_header
+ *	struct cache_entry, path, then the module's data, for each module
  *
+ * and everything is padded out to 8 bytes so the version and device
+ * tables can be used in place.
  */
-static struct module *grab_dir(const char *dirname,
-			       DIR *dir,
-			       struct module *next,
-			       do_module_t do_mod,
-			       struct module_search *search,
-			       struct module_overrides *overrides)
+#define CACHE_NAME	"modules.cache"
+#define CACHE_MAGIC	0x6d6f6463	/* "modc" */
+#define CACHE_VERSION	1
+
+struct cache_header
 {
-	struct dirent *dirent;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t pad;
+};
 
-	while ((dirent = readdir(dir)) != NULL) {
-		if (smells_like_module(dirent->d_name))
-			next = do_mod(dirname, dirent->d_name, next,
-				      search, overrides);
-		else if (!streq(dirent->d_name, ".")
-			 && !streq(dirent->d_name, "..")
-			 && !streq(dirent->d_name, "source")
-			 && !streq(dirent->d_name, "build")) {
-
-			DIR *sub;
-			char subdir[strlen(dirname) + 1
-				   + strlen(dirent->d_name) + 1];
-			sprintf(subdir, "%s/%s", dirname, dirent->d_name);
-			sub = opendir(subdir);
-			if (sub) {
-				next = grab_dir(subdir, sub, next, do_mod,
-						search, overrides);
-				closedir(sub);
-			}
-		}
-	}
-	return next;
-}
+/* Module was read with check_symvers set, endian converted, etc. */
+#define CACHE_VERSIONS		1
+#define CACHE_CONV		2
+#define CACHE_EXPORT_VERS	4
+#define CACHE_DEP_VERS		8
 
-/**
- * grab_basedir - top-level module processing
- *
- * @dirname:	top-level directory name
- * @search:	path search order
- * @overrides:	module overrides directives
- *
- */
-static struct module *grab_basedir(const char *dirname,
-				   struct module_search *search,
-				   struct module_overrides *overrides)
+struct cache_entry
 {
-	DIR *dir;
-	struct module *list;
+	/* The module file is unchanged if these are */
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	uint32_t mtime_nsec;
+
+	uint32_t len;		/* of the whole entry */
+	uint32_t flags;
+	uint32_t path_len;	/* including the nul */
+	char path[0];		/* relative to the module directory */
+};
 
-	dir = opendir(dirname);
-	if (!dir) {
-		warn("Couldn't open directory %s: %s\n",
-		     dirname, strerror(errno));
+/* Cache found by load_cache(), kept until we exit as modules point into it */
+static struct module_cache
+{
+	void *data;
+	unsigned long size;
+	const char *dirname;
+	struct module_hash paths;
+	struct cache_entry **entries;
+} cache;
+
+/* Ignore any cache we find (but still write a new one)? */
+static int rebuild_cache;
+
+struct cache_reader
+{
+	const char *pos, *end;
+};
+
+/* Next len bytes from the cache, or NULL (from now on) if there aren't */
+static void *cache_get(struct cache_reader *r, size_t len)
+{
+	const char *p = r->pos;
+
+	if (!p || len > r->end - p) {
+		r->pos = NULL;
 		return NULL;
 	}
-	list = grab_dir(dirname, dir, NULL, do_module, search, overrides);
-	closedir(dir);
+	r->pos = (r->end - p) < ALIGN8(len) ? r->end : p + ALIGN8(len);
+	return (void *)p;
+}
 
-	return list;
+static int cache_get_strings(struct cache_reader *r, struct string_table **tbl)
+{
+	const uint32_t *hdr = cache_get(r, 2 * sizeof(*hdr));
+	const char *p, *end;
+	uint32_t i;
+
+	*tbl = NULL;
+	if (!hdr || !(p = cache_get(r, hdr[1])))
+		return 0;
+	end = p + hdr[1];
+	for (i = 0; i < hdr[0]; i++) {
+		const char *nul = memchr(p, '\0', end - p);
+
+		if (!nul) {
+			strtbl_free(*tbl);
+			*tbl = NULL;
+			return 0;
+		}
+		*tbl = NOFAIL(strtbl_add(p, *tbl));
+		p = nul + 1;
+	}
+	return 1;
+}
+
+static int cache_get_vers(struct cache_reader *r, struct string_table *tbl,
+			  uint64_t **vers)
+{
+	*vers = cache_get(r, (tbl ? tbl->cnt : 0) * sizeof(**vers));
+	return *vers != NULL;
+}
+
+static void *cache_get_table(struct cache_reader *r, struct table_ref *ref)
+{
+	const uint32_t *hdr = cache_get(r, 4 * sizeof(*hdr));
+
+	if (!hdr)
+		return NULL;
+	*ref->size = hdr[0];
+	*ref->table_size = hdr[1];
+	return hdr[2] ? cache_get(r, hdr[2]) : NULL;
 }
 
 /**
- * sort_modules - order modules in list on modules.order if available
+ * read_cache_entry - fill in a module from its cache entry
  *
- * @dirname:	directory name
- * @list:	module list
+ * @e:		entry, already checked against the module file
+ * @mod:	module, not yet read
  *
- * Using the modules.order file (if available), give every module an index
- * based on its position in the file, and order list based on the index. If
- * no ordering data is available, fallback to existing unordered list.
+ * Returns 0 if the entry turns out to be broken.
  *
  */
-static struct module *sort_modules(const char *dirname, struct module *list)
+static int read_cache_entry(struct cache_entry *e, struct module *mod)
 {
-	struct module *tlist = NULL, **tpos = &tlist;
-	FILE *modorder;
-	int dir_len = strlen(dirname) + 1;
-	char file_name[dir_len + strlen("modules.order") + 1];
-	char line[10240];
-	unsigned int linenum = 0;
-
-	sprintf(file_name, "%s/%s", dirname, "modules.order");
-
-	modorder = fopen(file_name, "r");
-	if (!modorder) {
-		/* Older kernels don't generate modules.order.  Just
-		   return if the file doesn't exist. */
-		if (errno == ENOENT)
-			return list;
-		fatal("Could not open '%s': %s\n", file_name, strerror(errno));
-	}
+	struct cache_reader r = { (char *)e, (char *)e + e->len };
+	struct table_ref refs[NUM_TABLES];
+	const uint32_t *offset;
+	unsigned int j;
+	int ok;
+
+	cache_get(&r, sizeof(*e) + e->path_len);
+	ok = cache_get_strings(&r, &mod->exports);
+	if (ok && (e->flags & CACHE_EXPORT_VERS))
+		ok = cache_get_vers(&r, mod->exports, &mod->export_vers);
+	ok = ok && cache_get_strings(&r, &mod->dep_syms)
+		&& cache_get_strings(&r, &mod->dep_types);
+	if (ok && (e->flags & CACHE_DEP_VERS))
+		ok = cache_get_vers(&r, mod->dep_syms, &mod->dep_vers);
+	ok = ok && cache_get_strings(&r, &mod->modalias)
+		&& cache_get_strings(&r, &mod->modinfo);
+
+	mod->tables.conv = !!(e->flags & CACHE_CONV);
+	get_table_refs(&mod->tables, refs);
+	for (j = 0; j < NUM_TABLES; j++)
+		*refs[j].table = cache_get_table(&r, &refs[j]);
+	offset = cache_get(&r, 2 * sizeof(*offset));
+	if (offset)
+		mod->tables.pnp_card_offset = offset[0];
+
+	/* Without check_symvers, read_module() doesn't get versions. */
+	if (!check_symvers)
+		mod->export_vers = mod->dep_vers = NULL;
+	mod->cacheable = 1;
+
+	if (ok && r.pos)
+		return 1;
 
-	sprintf(line, "%s/", dirname);
+	strtbl_free(mod->exports);
+	strtbl_free(mod->dep_syms);
+	strtbl_free(mod->dep_types);
+	strtbl_free(mod->modalias);
+	strtbl_free(mod->modinfo);
+	return 0;
+}
 
-	/* move modules listed in modorder file to tlist in order */
-	while (fgets(line, sizeof(line), modorder)) {
-		struct module **pos, *mod;
-		int len = strlen(line);
+/**
+ * load_cache - read the cache in the module directory
+ *
+ * @dirname:	module directory
+ *
+ * A cache which is missing, or not one we understand, is just ignored.
+ *
+ */
+static void load_cache(const char *dirname)
+{
+	const struct cache_header *hdr;
+	struct cache_reader r;
+	char *name;
+	uint32_t i;
 
-		linenum++;
-		if (line[len - 1] == '\n')
-			line[len - 1] = '\0';
+	cache.dirname = dirname;
+	if (rebuild_cache)
+		return;
 
-		for (pos = &list; (mod = *pos); pos = &(*pos)->next) {
-			if (streq(line, mod->pathname + dir_len)) {
-				mod->order = linenum;
-				*pos = mod->next;
-				mod->next = NULL;
-				*tpos = mod;
-				tpos = &mod->next;
-				break;
-			}
-		}
-	}
+	nofail_asprintf(&name, "%s/%s", dirname, CACHE_NAME);
+	cache.data = grab_file(name, &cache.size);
+	free(name);
+	if (!cache.data)
+		return;
 
-	/* append the rest */
-	*tpos = list;
+	r.pos = cache.data;
+	r.end = r.pos + cache.size;
+	hdr = cache_get(&r, sizeof(*hdr));
+	if (!hdr || hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION
+	    || hdr->count > cache.size / sizeof(struct cache_entry))
+		return;
 
-	fclose(modorder);
+	cache.entries = NOFAIL(malloc(hdr->count * sizeof(*cache.entries)));
+	for (i = 0; i < hdr->count; i++) {
+		struct cache_entry *e = cache_get(&r, sizeof(*e));
 
-	return tlist;
+		if (!e || e->len < sizeof(*e) + e->path_len
+		    || !cache_get(&r, e->len - sizeof(*e))
+		    || !e->path_len || e->path[e->path_len - 1] != '\0')
+			break;
+		cache.entries[i] = e;
+		module_hash_add(&cache.paths, e->path, i + 1);
+	}
 }
 
 /**
- * calculate_deps - calculate deps for module
+ * cached_module - make up a module from the cache, if it's unchanged
  *
- * @module:	module to process
+ * @dirname:	path prefix
+ * @filename:	filename within path
+ *
+ * Returns NULL if the module has to be read after all.
  *
  */
-static void calculate_deps(struct module *module)
+static struct module *cached_module(const char *dirname, const char *filename)
+{
+	struct module *new;
+	struct module_hash_entry *h;
+	struct cache_entry *e;
+	struct stat st;
+
+	if (!cache.paths.count)
+		return NULL;
+
+	new = new_module(dirname, filename);
+	h = module_hash_find(&cache.paths,
+			     compress_path(new->pathname, cache.dirname));
+	if (!h->n)
+		goto miss;
+	e = cache.entries[h->n - 1];
+	if (stat(new->pathname, &st) != 0
+	    || e->ino != st.st_ino
+	    || e->size != st.st_size
+	    || e->mtime != st.st_mtim.tv_sec
+	    || e->mtime_nsec != st.st_mtim.tv_nsec)
+		goto miss;
+	if (check_symvers && !(e->flags & CACHE_VERSIONS))
+		goto miss;
+	if (!read_cache_entry(e, new))
+		goto miss;
+	set_module_stat(new, &st);
+	new->loaded = 1;
+	parse_modinfo(new);
+	stats.cached++;
+	return new;
+
+miss:
+	free(new);
+	return NULL;
+}
+
+/* Growing buffer for write_cache() */
+struct cache_buf
+{
+	char *data;
+	size_t len, max;
+};
+
+/* Append len bytes (or zeroes, if data is NULL) and pad */
+static void cache_put(struct cache_buf *b, const void *data, size_t len)
+{
+	size_t padded = ALIGN8(len);
+
+	if (b->len + padded > b->max) {
+		while (b->len + padded > b->max)
+			b->max = b->max ? b->max * 2 : 65536;
+		b->data = NOFAIL(realloc(b->data, b->max));
+	}
+	if (data)
+		memcpy(b->data + b->len, data, len);
+	else
+		memset(b->data + b->len, 0, len);
+	memset(b->data + b->len + len, 0, padded - len);
+	b->len += padded;
+}
+
+static void cache_put_strings(struct cache_buf *b,
+			      const struct string_table *tbl)
 {
+	uint32_t hdr[2] = { 0, 0 };
+	size_t start;
 	unsigned int i;
-	struct string_table *symnames;
-	struct string_table *symtypes;
-	uint64_t *symvers = NULL;
-	struct elf_file *file;
 
-	module->num_deps = 0;
-	module->deps = NULL;
-	file = module->file;
+	for (i = 0; tbl && i < tbl->cnt; i++)
+		hdr[1] += strlen(tbl->str[i]) + 1;
+	hdr[0] = tbl ? tbl->cnt : 0;
+	cache_put(b, hdr, sizeof(hdr));
 
-	symnames = file->ops->load_dep_syms(file, &symtypes,
-			check_symvers ? &symvers : NULL);
-	if (!symnames || !symtypes)
-		return;
+	start = b->len;
+	cache_put(b, NULL, hdr[1]);
+	for (i = 0; tbl && i < tbl->cnt; i++) {
+		size_t len = strlen(tbl->str[i]) + 1;
 
-	for (i = 0; i < symnames->cnt; i++) {
-		const char *name;
-		uint64_t ver;
-		struct module *owner;
-		int weak;
+		memcpy(b->data + start, tbl->str[i], len);
+		start += len;
+	}
+}
 
-		name = symnames->str[i];
-		ver = symvers ? symvers[i] : 0;
-		weak = (*(symtypes->str[i]) == 'W');
-		owner = find_symbol(name, ver, module->pathname, weak);
-		if (owner) {
-			info("%s needs \"%s\": %s\n",
-			       module->pathname, name,
-			       owner->pathname);
-			add_dep(module, owner);
-		}
+static void cache_put_table(struct cache_buf *b, const struct table_ref *ref)
+{
+	uint32_t hdr[4] = { *ref->size, *ref->table_size, 0, 0 };
+
+	if (*ref->table)
+		hdr[2] = table_copy_len(hdr[0], hdr[1]);
+	cache_put(b, hdr, sizeof(hdr));
+	if (*ref->table) {
+		cache_put(b, *ref->table, hdr[1]);
+		cache_put(b, NULL, 2 * hdr[0]);
 	}
+}
 
-	free(symnames);
-	free(symtypes);
-	free(symvers);
+static void cache_put_module(struct cache_buf *b, struct module *mod)
+{
+	struct module_tables *t = &mod->tables;
+	const char *path = compress_path(mod->pathname, cache.dirname);
+	struct table_ref refs[NUM_TABLES];
+	struct cache_entry e;
+	uint32_t offset[2] = { t->pnp_card_offset, 0 };
+	size_t start = b->len;
+	unsigned int j;
+
+	memset(&e, 0, sizeof(e));
+	e.ino = mod->ino;
+	e.size = mod->size;
+	e.mtime = mod->mtime;
+	e.mtime_nsec = mod->mtime_nsec;
+	e.flags = (check_symvers ? CACHE_VERSIONS : 0)
+		| (t->conv ? CACHE_CONV : 0)
+		| (mod->export_vers ? CACHE_EXPORT_VERS : 0)
+		| (mod->dep_vers ? CACHE_DEP_VERS : 0);
+	e.path_len = strlen(path) + 1;
+	cache_put(b, NULL, sizeof(e) + e.path_len);
+	memcpy(b->data + start, &e, sizeof(e));
+	memcpy(b->data + start + sizeof(e), path, e.path_len);
+
+	cache_put_strings(b, mod->exports);
+	if (mod->export_vers)
+		cache_put(b, mod->export_vers,
+			  mod->exports->cnt * sizeof(*mod->export_vers));
+	cache_put_strings(b, mod->dep_syms);
+	cache_put_strings(b, mod->dep_types);
+	if (mod->dep_vers)
+		cache_put(b, mod->dep_vers,
+			  mod->dep_syms->cnt * sizeof(*mod->dep_vers));
+	cache_put_strings(b, mod->modalias);
+	cache_put_strings(b, mod->modinfo);
+
+	get_table_refs(t, refs);
+	for (j = 0; j < NUM_TABLES; j++)
+		cache_put_table(b, &refs[j]);
+	cache_put(b, offset, sizeof(offset));
+
+	((struct cache_entry *)(b->data + start))->len = b->len - start;
 }
 
 /**
- * parse_modules - process the modules list
+ * write_cache - save what was read from the modules for next time
  *
- * @module:	module list
+ * @list:	module list
  *
- * Process each module in the (sorted by sort_modules) list for symbols,
- * dependencies, and other meta-data that will be output later.
+ * Only does anything if load_cache() was called.  The cache is just an
+ * optimisation, so failing to write it is not fatal.
  *
  */
-static struct module *parse_modules(struct module *list)
+static void write_cache(struct module *list)
 {
+	struct cache_buf b = { NULL, 0, 0 };
+	struct cache_header hdr = { CACHE_MAGIC, CACHE_VERSION, 0, 0 };
+	char *name, *tmpname;
 	struct module *i;
-	struct elf_file *file;
-	struct string_table *syms;
-	int j;
+	FILE *out;
+	int ok;
+
+	if (!cache.dirname)
+		return;
 
+	cache_put(&b, &hdr, sizeof(hdr));
 	for (i = list; i; i = i->next) {
-		uint64_t *symvers = NULL;
-		file = i->file;
-		syms = file->ops->load_symbols(file,
-				check_symvers ? &symvers : NULL);
-		if (syms) {
-			for (j = 0; j < syms->cnt; j++)
-				add_symbol(skip_symprefix(syms->str[j]),
-					symvers ? symvers[j] : 0, i);
-			strtbl_free(syms);
-		}
-		free(symvers);
-		file->ops->fetch_tables(file, &i->tables);
+		if (!i->cacheable)
+			continue;
+		cache_put_module(&b, i);
+		hdr.count++;
 	}
-	
-	for (i = list; i; i = i->next)
-		calculate_deps(i);
-	
-	/* Strip out modules with dependency loops. */
- again:
-	for (i = list; i; i = i->next) {
-		if (has_dep_loop(i, NULL)) {
-			warn("Module %s ignored, due to loop\n",
-			     i->pathname + skipchars);
-			del_module(&list, i);
-			goto again;
-		}
+	memcpy(b.data, &hdr, sizeof(hdr));
+
+	nofail_asprintf(&name, "%s/%s", cache.dirname, CACHE_NAME);
+	nofail_asprintf(&tmpname, "%s/%s.temp", cache.dirname, CACHE_NAME);
+	out = fopen(tmpname, "w");
+	if (!out) {
+		warn("Could not open %s for writing: %s\n",
+		     tmpname, strerror(errno));
+		goto out;
 	}
-	
-	return list;
+	ok = fwrite(b.data, 1, b.len, out) == b.len;
+	if (fclose(out) != 0 || !ok) {
+		warn("Could not write %s: %s\n", tmpname, strerror(errno));
+		unlink(tmpname);
+	} else if (rename(tmpname, name) < 0) {
+		warn("Could not rename %s into %s: %s\n",
+		     tmpname, name, strerror(errno));
+		unlink(tmpname);
+	}
+out:
+	free(tmpname);
+	free(name);
+	free(b.data);
 }
 
+/* Modules found so far, and one of each basename picked from them */
+struct module_set
+{
+	unsigned int num_found, max_found;
+	struct module **found;		/* in the order found */
+
+	struct module_hash names;
+	unsigned int count, max;
+	struct module **mods;		/* in the order first found */
+};
+
+typedef void (*do_module_t)(struct module_set *set,
+			    const char *dirname,
+			    const char *filename,
+			    struct module_search *search,
+			    struct module_overrides *overrides);
+
 /**
- * output_symbols - output symbol alias information
+ * is_higher_priority - find modules replacing other modules
  *
- * @unused:	unused
- * @out:	output file reference
- * @dirname:	output directory
+ * @newpath:	new module path
+ * @oldpath:	old module path
+ * @search:	path search order
+ * @overrides:	module override directives
  *
- * Output the symbol hash table, in the form of symbol alias entries, to
- * an ascii text file of the form modules.symbols (depending on file).
+ * Compares one module (path) to another module (path) and determines
+ * whether the new module should replace the existing module of the
+ * same name. Overriding is handled very coarsely for the moment.
  *
  */
-static int output_symbols(struct module *unused, FILE *out, char *dirname)
+static int is_higher_priority(const char *newpath, const char *oldpath,
+			      struct module_search *search,
+			      struct module_overrides *overrides)
 {
-	unsigned int i;
+	struct module_search *tmp;
+	struct module_overrides *ovtmp;
+	int i = 0;
+	int prio_builtin = -1;
+	int prio_new = -1;
+	int prio_old = -1;
 
-	fprintf(out, "# Aliases for symbols, used by symbol_request().\n");
-	for (i = 0; i < SYMBOL_HASH_SIZE; i++) {
-		struct symbol *s;
-
-		for (s = symbolhash[i]; s; s = s->next) {
-			if (s->owner) {
-				char modname[strlen(s->owner->pathname)+1];
-				filename2modname(modname, s->owner->pathname);
-				fprintf(out, "alias symbol:%s %s\n",
-					s->name, modname);
-			}
-		}
+/* The names already match, now we check for overrides and directory search
+ * order
+ */
+	for (ovtmp = overrides; ovtmp != NULL; ovtmp = ovtmp->next) {
+		if (streq(ovtmp->modfile, newpath))
+			return 1;
+		if (streq(ovtmp->modfile, oldpath))
+			return 0;
 	}
-	return 1;
+	for (i = 0, tmp = search; tmp != NULL; tmp = tmp->next, i++) {
+		if (streq(tmp->search_path, MODULE_BUILTIN_KEY))
+			prio_builtin = i;
+		else if (strncmp(tmp->search_path, newpath, tmp->len) == 0)
+			prio_new = i;
+		else if (strncmp(tmp->search_path, oldpath, tmp->len) == 0)
+			prio_old = i;
+	}
+	if (prio_new < 0)
+		prio_new = prio_builtin;
+	if (prio_old < 0)
+		prio_old = prio_builtin;
+
+	return prio_new > prio_old;
 }
 
 /**
- * output_symbols_bin - output symbol alias information in binary format
+ * do_module - process a module file
  *
- * @unused:	unused
- * @out:	output file reference
- * @dirname:	output directory
+ * @set:	modules found so far
+ * @dirname:	directory containing module
+ * @filename:	module disk file
+ * @search:	path search order
+ * @overrides:	module override directives
  *
- * Output the symbol hash table, in the form of symbol alias entries, to
- * a trie ordered output file e.g. of the form modules.symbols.bin.
+ * The module is only read later, by read_modules().
  *
  */
-static int output_symbols_bin(struct module *unused, FILE *out, char *dirname)
+static void do_module(struct module_set *set,
+		      const char *dirname,
+		      const char *filename,
+		      struct module_search *search,
+		      struct module_overrides *overrides)
 {
-	struct index_node *index;
-	unsigned int i;
-	char *alias;
-	int duplicate;
+	struct module *new;
 
-	index = index_create();
-	
-	for (i = 0; i < SYMBOL_HASH_SIZE; i++) {
-		struct symbol *s;
-
-		for (s = symbolhash[i]; s; s = s->next) {
-			if (s->owner) {
-				char modname[strlen(s->owner->pathname)+1];
-				filename2modname(modname, s->owner->pathname);
-				nofail_asprintf(&alias, "symbol:%s", s->name);
-				duplicate = index_insert(index, alias, modname,
-							 s->owner->order);
-				if (duplicate && warn_dups)
-					warn("duplicate module syms:\n%s %s\n",
-						alias, modname);
-				free(alias);
-			}
-		}
-	}
-	
-	index_write(index, out);
-	index_destroy(index);
+	new = cached_module(dirname, filename);
+	if (!new)
+		new = new_module(dirname, filename);
 
-	return 1;
+	if (set->num_found == set->max_found) {
+		set->max_found = set->max_found ? set->max_found * 2 : 256;
+		set->found = NOFAIL(realloc(set->found, set->max_found
+					    * sizeof(*set->found)));
+	}
+	set->found[set->num_found++] = new;
 }
 
 /**
- * output_builtin_bin - output list of built-in modules in binary format
+ * pick_module - keep a module, unless overridden
  *
- * @unused:	unused
- * @out:	output file reference
+ * @set:	modules found so far
+ * @new:	module, taken in the order found
+ * @search:	path search order
+ * @overrides:	module override directives
+ *
+ * Modules passed over stay in set->found, in case the one picked
+ * instead can't be read.
+ *
+ */
+static void pick_module(struct module_set *set,
+			struct module *new,
+			struct module_search *search,
+			struct module_overrides *overrides)
+{
+	struct module **old;
+	struct module_hash_entry *e;
+
+	/* Check if we have a module of this name already. */
+	e = module_hash_add(&set->names, new->basename, set->count + 1);
+	if (e->n != set->count + 1) {
+		old = &set->mods[e->n - 1];
+
+		/* if module matches an existing entry (name) but */
+		/* has a higher priority, replace existing entry. */
+		if (is_higher_priority(new->pathname, (*old)->pathname,
+				       search, overrides)) {
+			*old = new;
+			e->key = new->basename;
+		}
+		return;
+	}
+
+	if (set->count == set->max) {
+		set->max = set->max ? set->max * 2 : 256;
+		set->mods = NOFAIL(realloc(set->mods,
+					   set->max * sizeof(*set->mods)));
+	}
+	set->mods[set->count++] = new;
+}
+
+/* Number of threads to use (0 for one per CPU) */
+static unsigned int jobs;
+
+static unsigned int num_threads(void)
+{
+	long cpus;
+
+	if (jobs)
+		return jobs;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+/**
+ * is_dir_entry - check whether a directory entry is a directory
+ *
+ * @dirfd:	open directory
+ * @dirent:	entry in it
+ * @follow:	whether a symlink to a directory counts
+ *
+ * Most filesystems fill in d_type, so we only need to stat the entry when
+ * they don't (or to see where a symlink goes).  Returns -1 if we couldn't.
+ *
+ */
+static int is_dir_entry(int dirfd, const struct dirent *dirent, int follow)
+{
+	struct stat st;
+
+	if (dirent->d_type == DT_DIR)
+		return 1;
+	if (dirent->d_type != DT_UNKNOWN
+	    && !(follow && dirent->d_type == DT_LNK))
+		return 0;
+	if (fstatat(dirfd, dirent->d_name, &st,
+		    follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+		return -1;
+	return S_ISDIR(st.st_mode);
+}
+
+/*
+ * The module tree is read into memory first, a directory at a time and
+ * possibly several at once, then walked in readdir order to add the
+ * modules to the list in the same order as a plain recursive scan would.
+ */
+struct scan_dir
+{
+	/* Open until the directory has been read */
+	int fd;
+
+	/* Module files and subdirectories, in readdir order */
+	unsigned int num_entries, max_entries;
+	struct scan_entry {
+		char *filename;
+		struct scan_dir *sub;
+	} *entries;
+
+	/* Next directory waiting to be read */
+	struct scan_dir *next;
+
+	char dirname[0];
+};
+
+struct scan_queue
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct scan_dir *head;
+	/* Directories waiting, the most we let wait, and being read */
+	unsigned int queued, max_queued, busy;
+};
+
+static struct scan_dir *new_scan_dir(const char *parent, const char *name,
+				     int fd)
+{
+	struct scan_dir *dir;
+
+	dir = NOFAIL(calloc(1, sizeof(*dir) + strlen(parent) + 1
+			    + strlen(name ?: "") + 1));
+	if (name)
+		sprintf(dir->dirname, "%s/%s", parent, name);
+	else
+		strcpy(dir->dirname, parent);
+	dir->fd = fd;
+	return dir;
+}
+
+static struct scan_entry *add_scan_entry(struct scan_dir *dir)
+{
+	if (dir->num_entries == dir->max_entries) {
+		dir->max_entries = dir->max_entries * 2 ?: 16;
+		dir->entries = NOFAIL(realloc(dir->entries, dir->max_entries
+					      * sizeof(*dir->entries)));
+	}
+	memset(&dir->entries[dir->num_entries], 0, sizeof(*dir->entries));
+	return &dir->entries[dir->num_entries++];
+}
+
+/* Leave a subdirectory for an idle thread, if there's room in the queue */
+static int queue_scan_dir(struct scan_queue *queue, struct scan_dir *dir)
+{
+	int queued = 0;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->queued < queue->max_queued) {
+		dir->next = queue->head;
+		queue->head = dir;
+		queue->queued++;
+		queued = 1;
+		pthread_cond_signal(&queue->wake);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return queued;
+}
+
+/**
+ * scan_dir - read a directory, and those below it not left to other threads
+ *
+ * @queue:	directories waiting to be read
+ * @dir:	directory to read
+ *
+ */
+static void scan_dir(struct scan_queue *queue, struct scan_dir *dir)
+{
+	DIR *dirp;
+	struct dirent *dirent;
+
+	dirp = fdopendir(dir->fd);
+	if (!dirp) {
+		close(dir->fd);
+		return;
+	}
+
+	while ((dirent = readdir(dirp)) != NULL) {
+		struct scan_dir *sub;
+		int fd;
+
+		if (smells_like_module(dirent->d_name)) {
+			add_scan_entry(dir)->filename
+				= NOFAIL(strdup(dirent->d_name));
+			continue;
+		}
+		if (streq(dirent->d_name, ".")
+		    || streq(dirent->d_name, "..")
+		    || streq(dirent->d_name, "source")
+		    || streq(dirent->d_name, "build")
+		    || is_dir_entry(dirfd(dirp), dirent, 1) <= 0)
+			continue;
+
+		fd = openat(dirfd(dirp), dirent->d_name,
+			    O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			continue;
+		sub = new_scan_dir(dir->dirname, dirent->d_name, fd);
+		add_scan_entry(dir)->sub = sub;
+		if (!queue_scan_dir(queue, sub))
+			scan_dir(queue, sub);
+	}
+	closedir(dirp);
+}
+
+static void *scan_thread(void *data)
+{
+	struct scan_queue *queue = data;
+	struct scan_dir *dir;
+
+	pthread_mutex_lock(&queue->lock);
+	for (;;) {
+		/* Whoever is busy may yet queue more */
+		while (!queue->head && queue->busy)
+			pthread_cond_wait(&queue->wake, &queue->lock);
+		dir = queue->head;
+		if (!dir)
+			break;
+		queue->head = dir->next;
+		queue->queued--;
+		queue->busy++;
+		pthread_mutex_unlock(&queue->lock);
+
+		scan_dir(queue, dir);
+
+		pthread_mutex_lock(&queue->lock);
+		queue->busy--;
+		if (!queue->busy && !queue->head)
+			pthread_cond_broadcast(&queue->wake);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return NULL;
+}
+
+/* Add the modules found by scan_dir in order, freeing the tree as we go */
+static void walk_scan_dir(struct scan_dir *dir,
+			  struct module_set *set,
+			  do_module_t do_mod,
+			  struct module_search *search,
+			  struct module_overrides *overrides)
+{
+	unsigned int i;
+
+	for (i = 0; i < dir->num_entries; i++) {
+		struct scan_entry *e = &dir->entries[i];
+
+		if (e->sub)
+			walk_scan_dir(e->sub, set, do_mod, search, overrides);
+		else {
+			do_mod(set, dir->dirname, e->filename,
+			       search, overrides);
+			free(e->filename);
+		}
+	}
+	free(dir->entries);
+	free(dir);
+}
+
+/**
+ * grab_dir - process a directory of modules
+ *
+ * @dirname:	directory name
+ * @fd:		open directory, closed for us
+ * @set:	modules found so far
+ * @do_mod:	do_module function to use
+ * @search:	path search order
+ * @overrides:	module overrides directives
+ *
+ * Subdirectories are opened relative to their parent and only stat()ed
+ * when the filesystem doesn't give their type.  Separate subtrees are
+ * read by up to num_threads() threads.
+ *
+ */
+static void grab_dir(const char *dirname,
+		     int fd,
+		     struct module_set *set,
+		     do_module_t do_mod,
+		     struct module_search *search,
+		     struct module_overrides *overrides)
+{
+	struct scan_dir *top = new_scan_dir(dirname, NULL, fd);
+	unsigned int threads = num_threads(), started, n;
+	struct scan_queue queue = { PTHREAD_MUTEX_INITIALIZER,
+				    PTHREAD_COND_INITIALIZER, top, 1,
+				    threads > 1 ? threads : 0, 0 };
+	pthread_t *tids;
+
+	/* We are one of the threads; if the others won't start, carry on */
+	tids = NOFAIL(calloc(threads, sizeof(*tids)));
+	for (started = 0; started < threads - 1; started++)
+		if (pthread_create(&tids[started], NULL,
+				   scan_thread, &queue) != 0)
+			break;
+	scan_thread(&queue);
+	for (n = 0; n < started; n++)
+		pthread_join(tids[n], NULL);
+	free(tids);
+
+	walk_scan_dir(top, set, do_mod, search, overrides);
+}
+
+/**
+ * sort_modules - order modules in list on modules.order if available
+ *
+ * @dirname:	directory name
+ * @list:	module list
+ *
+ * Using the modules.order file (if available), give every module an index
+ * based on its position in the file, and order list based on the index. If
+ * no ordering data is available, fallback to existing unordered list.
+ *
+ */
+static struct module *sort_modules(const char *dirname, struct module *list)
+{
+	struct module *tlist = NULL, **tpos = &tlist;
+	FILE *modorder;
+	int dir_len = strlen(dirname) + 1;
+	char file_name[dir_len + strlen("modules.order") + 1];
+	char line[10240];
+	unsigned int linenum = 0;
+	struct module_hash paths = { 0, 0, NULL };
+	struct module **mods = NULL, *mod;
+	unsigned int i, count = 0;
+
+	sprintf(file_name, "%s/%s", dirname, "modules.order");
+
+	modorder = fopen(file_name, "r");
+	if (!modorder) {
+		/* Older kernels don't generate modules.order.  Just
+		   return if the file doesn't exist. */
+		if (errno == ENOENT)
+			return list;
+		fatal("Could not open '%s': %s\n", file_name, strerror(errno));
+	}
+
+	/* index the modules by path; the first of any duplicates wins */
+	for (mod = list; mod; mod = mod->next)
+		count++;
+	mods = NOFAIL(malloc((count ?: 1) * sizeof(*mods)));
+	for (i = 0, mod = list; mod; i++, mod = mod->next) {
+		mods[i] = mod;
+		module_hash_add(&paths, mod->pathname + dir_len, i + 1);
+	}
+
+	/* move modules listed in modorder file to tlist in order */
+	while (fgets(line, sizeof(line), modorder)) {
+		struct module_hash_entry *e;
+		int len = strlen(line);
+
+		linenum++;
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		if (!paths.size)
+			continue;
+		e = module_hash_find(&paths, line);
+		if (e->n && mods[e->n - 1]) {
+			mod = mods[e->n - 1];
+			mods[e->n - 1] = NULL;
+			mod->order = linenum;
+			*tpos = mod;
+			tpos = &mod->next;
+		}
+	}
+
+	/* append the rest */
+	for (i = 0; i < count; i++) {
+		if (mods[i]) {
+			*tpos = mods[i];
+			tpos = &mods[i]->next;
+		}
+	}
+	*tpos = NULL;
+
+	free(paths.entries);
+	free(mods);
+	fclose(modorder);
+
+	return tlist;
+}
+
+
+/* Can the tables be copied?  Only as much as the module says it has is. */
+static int tables_copyable(struct module *module)
+{
+	struct table_ref refs[NUM_TABLES];
+	unsigned int j;
+
+	get_table_refs(&module->tables, refs);
+	for (j = 0; j < NUM_TABLES; j++)
+		if (*refs[j].table && !*refs[j].table_size)
+			return 0;
+	return 1;
+}
+
+/* Would the cache give the same as reading it?  Not if we warned. */
+static int module_cacheable(struct module *module)
+{
+	struct elf_file *file = module->file;
+	unsigned long size;
+
+	if (!file->ops->load_section(file, ".symtab", &size)
+	    || !file->ops->load_section(file, ".strtab", &size))
+		return 0;
+	if (check_symvers && !module->dep_vers)
+		return 0;
+	return tables_copyable(module);
+}
+
+/* Bytes to copy the strings of a table into */
+static size_t strings_len(const struct string_table *tbl)
+{
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; tbl && i < tbl->cnt; i++)
+		len += strlen(tbl->str[i]) + 1;
+	return len;
+}
+
+static char *copy_strings(struct string_table *tbl, char *to)
+{
+	unsigned int i;
+
+	for (i = 0; tbl && i < tbl->cnt; i++) {
+		size_t len = strlen(tbl->str[i]) + 1;
+
+		memcpy(to, tbl->str[i], len);
+		tbl->str[i] = to;
+		to += len;
+	}
+	return to;
+}
+
+/**
+ * copy_module_data - copy what read_module() found out of the ELF file
+ *
+ * @module:	module just read
+ *
+ * The strings and tables point into the file; copy them into one block
+ * of their own so that the file can go.  Returns 0 if they can't be.
+ *
+ */
+static int copy_module_data(struct module *module)
+{
+	struct table_ref refs[NUM_TABLES];
+	size_t len = 0;
+	unsigned int j;
+	char *p;
+
+	if (!tables_copyable(module))
+		return 0;
+
+	get_table_refs(&module->tables, refs);
+	for (j = 0; j < NUM_TABLES; j++)
+		if (*refs[j].table)
+			len += table_copy_len(*refs[j].size,
+					      *refs[j].table_size);
+	len += strings_len(module->exports) + strings_len(module->dep_syms)
+		+ strings_len(module->dep_types)
+		+ strings_len(module->modalias) + strings_len(module->modinfo);
+
+	/* Tables first, as they want aligning */
+	p = module->data = NOFAIL(calloc(1, len ?: 1));
+	for (j = 0; j < NUM_TABLES; j++) {
+		if (!*refs[j].table)
+			continue;
+		memcpy(p, *refs[j].table, *refs[j].table_size);
+		*refs[j].table = p;
+		p += table_copy_len(*refs[j].size, *refs[j].table_size);
+	}
+	p = copy_strings(module->exports, p);
+	p = copy_strings(module->dep_syms, p);
+	p = copy_strings(module->dep_types, p);
+	p = copy_strings(module->modalias, p);
+	copy_strings(module->modinfo, p);
+	return 1;
+}
+
+/**
+ * read_module - extract what we need from a module's ELF file
+ *
+ * @module:	module to read
+ *
+ * Everything the later passes want out of the module itself is pulled
+ * out here, so that they never go back to the file.  This only looks at
+ * the module, and so can run for several modules at once.
+ *
+ * The file is opened here if it wasn't already, and let go once what
+ * was found is copied out of it, so only the modules being read at the
+ * time are held in memory.  If it can't be opened, load_error says why.
+ *
+ */
+static void read_module(struct module *module)
+{
+	struct elf_file *file = module->file;
+
+	if (!file) {
+		file = module->file = load_elf_file(module);
+		if (!file) {
+			module->load_error = errno;
+			module->loaded = 1;
+			return;
+		}
+	}
+
+	module->exports = file->ops->load_symbols(file,
+			check_symvers ? &module->export_vers : NULL);
+	module->dep_syms = file->ops->load_dep_syms(file, &module->dep_types,
+			check_symvers ? &module->dep_vers : NULL);
+	file->ops->fetch_tables(file, &module->tables);
+	module->modalias = file->ops->load_strings(file, ".modalias", NULL);
+	module->modinfo = file->ops->load_strings(file, ".modinfo", NULL);
+	module->cacheable = module_cacheable(module);
+
+	if (copy_module_data(module)) {
+		release_elf_file(file);
+		module->file = NULL;
+	}
+	module->loaded = 1;
+	parse_modinfo(module);
+}
+
+/* Modules still to be read, handed out in list order */
+struct read_queue
+{
+	pthread_mutex_t lock;
+	struct module *next;
+};
+
+static void *read_modules_thread(void *data)
+{
+	struct read_queue *queue = data;
+	struct module *i;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		i = queue->next;
+		if (i)
+			queue->next = i->next;
+		pthread_mutex_unlock(&queue->lock);
+		if (!i)
+			return NULL;
+		if (!i->loaded)
+			read_module(i);
+	}
+}
+
+/**
+ * read_modules - read every module in the list
+ *
+ * @list:	module list
+ *
+ * Nothing read here depends on the other modules, so the work is shared
+ * out between up to num_threads() threads.  Bar the order of any warnings about
+ * broken modules, the result is the same as reading them one by one.
+ * Modules which came from the cache, or were read already, are skipped.
+ *
+ */
+static void read_modules(struct module *list)
+{
+	struct read_queue queue = { PTHREAD_MUTEX_INITIALIZER, list };
+	unsigned int threads = num_threads(), count = 0, started, n;
+	struct module *i;
+	pthread_t *tids;
+
+	for (i = list; i && count < threads; i = i->next)
+		count++;
+
+	if (count <= 1) {
+		for (i = list; i; i = i->next)
+			if (!i->loaded)
+				read_module(i);
+		return;
+	}
+
+	/* We are one of the threads; if the others won't start, carry on */
+	tids = NOFAIL(calloc(count - 1, sizeof(*tids)));
+	for (started = 0; started < count - 1; started++)
+		if (pthread_create(&tids[started], NULL,
+				   read_modules_thread, &queue) != 0)
+			break;
+	read_modules_thread(&queue);
+	for (n = 0; n < started; n++)
+		pthread_join(tids[n], NULL);
+	free(tids);
+}
+
+/**
+ * grab_basedir - top-level module processing
+ *
+ * @dirname:	top-level directory name
+ * @search:	path search order
+ * @overrides:	module overrides directives
+ *
+ */
+static struct module *grab_basedir(const char *dirname,
+				   struct module_search *search,
+				   struct module_overrides *overrides)
+{
+	struct module_set set = { 0, 0, NULL, { 0, 0, NULL }, 0, 0, NULL };
+	struct module *list = NULL;
+	struct stats_timer t;
+	unsigned int i;
+	int fd, unreadable;
+
+	fd = open(dirname, O_RDONLY | O_DIRECTORY, 0);
+	if (fd < 0) {
+		warn("Couldn't open directory %s: %s\n",
+		     dirname, strerror(errno));
+		return NULL;
+	}
+	load_cache(dirname);
+	stats_start(&t, 0);
+	grab_dir(dirname, fd, &set, do_module, search, overrides);
+	stats_stop(&t, STATS_SCAN, 0);
+
+	/* Only read the module picked for each name.  If one can't be
+	   read, it is passed over for another of the same name, so pick
+	   again from those left until all those picked have been read. */
+	stats_start(&t, 0);
+	do {
+		set.count = 0;
+		set.names.count = 0;
+		if (set.names.entries)
+			memset(set.names.entries, 0,
+			       set.names.size * sizeof(*set.names.entries));
+		for (i = 0; i < set.num_found; i++)
+			if (!set.found[i]->load_error)
+				pick_module(&set, set.found[i],
+					    search, overrides);
+
+		/* The list has always had the first module found last. */
+		list = NULL;
+		for (i = 0; i < set.count; i++) {
+			set.mods[i]->next = list;
+			list = set.mods[i];
+		}
+		read_modules(list);
+
+		unreadable = 0;
+		for (i = 0; i < set.count; i++) {
+			if (set.mods[i]->load_error) {
+				warn("Can't read module %s: %s\n",
+				     set.mods[i]->pathname,
+				     strerror(set.mods[i]->load_error));
+				unreadable = 1;
+			}
+		}
+	} while (unreadable);
+	stats_stop(&t, STATS_READ, 0);
+
+	/* Let go of those which weren't picked */
+	for (i = 0; i < set.num_found; i++) {
+		struct module *mod = set.found[i];
+
+		if (mod->load_error)
+			free(mod);
+		else if (set.mods[module_hash_find(&set.names,
+						   mod->basename)->n - 1]
+			 != mod)
+			del_module(NULL, mod);
+	}
+	free(set.found);
+	free(set.names.entries);
+	free(set.mods);
+
+	return list;
+}
+
+/**
+ * calculate_deps - calculate deps for module
+ *
+ * @module:	module to process
+ *
+ */
+static void calculate_deps(struct module *module)
+{
+	unsigned int i;
+	struct string_table *symnames = module->dep_syms;
+	struct string_table *symtypes = module->dep_types;
+	uint64_t *symvers = module->dep_vers;
+
+	module->num_deps = 0;
+	module->deps = NULL;
+
+	if (!symnames || !symtypes)
+		return;
+
+	for (i = 0; i < symnames->cnt; i++) {
+		const char *name;
+		uint64_t ver;
+		struct module *owner;
+		int weak;
+
+		name = symnames->str[i];
+		ver = symvers ? symvers[i] : 0;
+		weak = (*(symtypes->str[i]) == 'W');
+		owner = find_symbol(name, ver, module->pathname, weak);
+		stats.lookups++;
+		if (owner) {
+			info("%s needs \"%s\": %s\n",
+			       module->pathname, name,
+			       owner->pathname);
+			add_dep(module, owner);
+		}
+	}
+}
+
+/**
+ * parse_modules - process the modules list
+ *
+ * @module:	module list
+ *
+ * Process each module in the (sorted by sort_modules) list for symbols,
+ * dependencies, and other meta-data that will be output later.
+ *
+ */
+static struct module *parse_modules(struct module *list)
+{
+	struct module *i, **pos;
+	struct loop_search search = { 0, NULL };
+	struct stats_timer parse, t;
+	int j;
+
+	stats_start(&parse, 0);
+	stats_start(&t, 0);
+	read_modules(list);
+	stats_stop(&t, STATS_READ, 0);
+
+	/* Which exporter find_symbol() picks depends on the order added. */
+	for (i = list; i; i = i->next) {
+		struct string_table *syms = i->exports;
+
+		for (j = 0; syms && j < syms->cnt; j++)
+			add_symbol(skip_symprefix(syms->str[j]),
+				   i->export_vers ? i->export_vers[j] : 0, i);
+		stats.symbols += syms ? syms->cnt : 0;
+	}
+	
+	stats_start(&t, 0);
+	for (i = list; i; i = i->next)
+		calculate_deps(i);
+	stats_stop(&t, STATS_DEPS, 0);
+	
+	/* Strip out modules with dependency loops. */
+	stats_start(&t, 0);
+	for (i = list; i; i = i->next)
+		if (!i->loop_index)
+			find_loops(i, &search);
+	for (pos = &list; (i = *pos) != NULL; ) {
+		if (i->report_loop)
+			report_loop(i);
+		if (i->in_loop) {
+			warn("Module %s ignored, due to loop\n",
+			     i->pathname + skipchars);
+			*pos = i->next;
+			del_module(NULL, i);
+		} else
+			pos = &i->next;
+	}
+	stats_stop(&t, STATS_LOOPS, 0);
+
+	order_deps(list);
+	stats_stop(&parse, STATS_PARSE, 0);
+	return list;
+}
+
+/* Size of the chain hash table symbols used to be kept in */
+#define OLD_SYMBOL_HASH_SIZE 1024
+
+static int symbol_output_cmp(const void *a, const void *b)
+{
+	const struct symbol *x = *(struct symbol * const *)a;
+	const struct symbol *y = *(struct symbol * const *)b;
+	unsigned int xb = x->hash % OLD_SYMBOL_HASH_SIZE;
+	unsigned int yb = y->hash % OLD_SYMBOL_HASH_SIZE;
+
+	if (xb != yb)
+		return xb < yb ? -1 : 1;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * The symbols exported by modules, in the order they have always been
+ * output in: that of the OLD_SYMBOL_HASH_SIZE chain hash table depmod
+ * used to keep them in, newest first within each chain.  Besides keeping modules.symbols
+ * stable, newest first matters for which of several exporters wins in
+ * the index.  The array ends with a NULL.
+ */
+static struct symbol **sort_symbols(void)
+{
+	struct symbol **sorted;
+	unsigned int i, count = 0;
+
+	sorted = NOFAIL(malloc((num_symbols + 1) * sizeof(*sorted)));
+	for (i = 0; i < num_symbols; i++)
+		if (symbols[i].owner)
+			sorted[count++] = &symbols[i];
+	qsort(sorted, count, sizeof(*sorted), symbol_output_cmp);
+	sorted[count] = NULL;
+	return sorted;
+}
+
+/**
+ * output_symbols - output symbol alias information
+ *
+ * @unused:	unused
+ * @out:	output file reference
+ * @dirname:	output directory
+ *
+ * Output the symbol hash table, in the form of symbol alias entries, to
+ * an ascii text file of the form modules.symbols (depending on file).
+ *
+ */
+static int output_symbols(struct module *unused, FILE *out, char *dirname)
+{
+	struct symbol **sorted = sort_symbols(), **s;
+
+	fprintf(out, "# Aliases for symbols, used by symbol_request().\n");
+	for (s = sorted; *s; s++) {
+		char modname[strlen((*s)->owner->pathname)+1];
+
+		filename2modname(modname, (*s)->owner->pathname);
+		fprintf(out, "alias symbol:%s %s\n", (*s)->name, modname);
+	}
+	free(sorted);
+	return 1;
+}
+
+/**
+ * output_symbols_bin - output symbol alias information in binary format
+ *
+ * @unused:	unused
+ * @out:	output file reference
+ * @dirname:	output directory
+ *
+ * Output the symbol hash table, in the form of symbol alias entries, to
+ * a trie ordered output file e.g. of the form modules.symbols.bin.
+ *
+ */
+static int output_symbols_bin(struct module *unused, FILE *out, char *dirname)
+{
+	struct index_node *index;
+	struct symbol **sorted = sort_symbols(), **s;
+	char *alias;
+	int duplicate;
+
+	index = index_create();
+	
+	for (s = sorted; *s; s++) {
+		char modname[strlen((*s)->owner->pathname)+1];
+
+		filename2modname(modname, (*s)->owner->pathname);
+		nofail_asprintf(&alias, "symbol:%s", (*s)->name);
+		duplicate = index_insert(index, alias, modname,
+					 (*s)->owner->order);
+		if (duplicate && warn_dups)
+			warn("duplicate module syms:\n%s %s\n",
+				alias, modname);
+		free(alias);
+	}
+	free(sorted);
+	
+	index_write(index, out);
+	index_destroy(index);
+
+	return 1;
+}
+
+/**
+ * output_builtin_bin - output list of built-in modules in binary format
+ *
+ * @unused:	unused
+ * @out:	output file reference
+ * @dirname:	output directory
+ *
+ */
+static int output_builtin_bin(struct module *unused, FILE *out, char *dirname)
+{
+	struct index_node *index;
+	char *textfile, *line;
+	unsigned int linenum;
+	FILE *f;
+
+	nofail_asprintf(&textfile, "%s/modules.builtin", dirname);
+	if (!(f = fopen(textfile, "r"))) {
+		if (errno != ENOENT)
+			fatal("Could not open '%s': %s\n",
+					textfile, strerror(errno));
+		free(textfile);
+		return 0;
+	}
+	free(textfile);
+	index = index_create();
+
+	while ((line = getline_wrapped(f, &linenum)) != NULL) {
+		char *module = line;
+
+		if (!*line || *line == '#') {
+			free(line);
+			continue;
+		}
+		filename2modname(module, module);
+		index_insert(index, module, "", 0);
+		free(line);
+	}
+	fclose(f);
+	index_write_hashed(index, out);
+	index_destroy(index);
+
+	return 1;
+}
+
+/**
+ * output_aliases - output list of module aliases
+ *
+ * @modules:	list of modules
+ * @out:	output file reference
+ * @dirname:	output directory
+ *
+ */
+static int output_aliases(struct module *modules, FILE *out, char *dirname)
+{
+	struct module *i;
+	struct string_table *tbl;
+	int j;
+
+	fprintf(out, "# Aliases extracted from modules themselves.\n");
+	for (i = modules; i; i = i->next) {
+		tbl = i->info.aliases;
+		for (j = 0; tbl && j < tbl->cnt; j++)
+			fprintf(out, "alias %s %s\n",
+				tbl->str[j], i->info.modname);
+	}
+	return 1;
+}
+
+/**
+ * index_aliases - add the aliases of one module to an alias index
+ *
+ * @index:	index to add to
+ * @i:		module
+ *
+ */
+static void index_aliases(struct index_node *index, struct module *i)
+{
+	struct string_table *tbl = i->info.aliases;
+	const char *modname = i->info.modname;
+	int j;
+	char *alias;
+	int duplicate;
+
+	for (j = 0; tbl && j < tbl->cnt; j++) {
+		alias = NOFAIL(strdup(tbl->str[j]));
+		underscores(alias);
+		duplicate = index_insert(index, alias, modname, i->order);
+		if (duplicate && warn_dups)
+			warn("duplicate module alias:\n%s %s\n",
+				alias, modname);
+		free(alias);
+	}
+}
+
+/**
+ * output_aliases_bin - output list of module aliases in binary format
+ *
+ * @modules:	list of modules
+ * @out:	outout file reference
+ * @dirname:	output directory
+ *
+ */
+static int output_aliases_bin(struct module *modules, FILE *out, char *dirname)
+{
+	struct module *i;
+	struct index_node *index;
+
+	index = index_create();
+	
+	for (i = modules; i; i = i->next)
+		index_aliases(index, i);
+	
+	index_write(index, out);
+	index_destroy(index);
+
+	return 1;
+}
+
+/**
+ * output_softdeps - output module softdeps (non-implicit dependencies)
+ *
+ * @modules:	list of modules
+ * @out:	output file reference
+ * @dirname:	output directory
+ *
+ */
+static int output_softdeps(struct module *modules, FILE *out, char *dirname)
+{
+	struct module *i;
+	struct string_table *tbl;
+	int j;
+
+	fprintf(out, "# Soft dependencies extracted from modules themselves.\n");
+	fprintf(out, "# Copy, with a .conf extension, to /etc/modprobe.d to use "
+		"it with modprobe.\n");
+	for (i = modules; i; i = i->next) {
+		tbl = i->info.softdeps;
+		for (j = 0; tbl && j < tbl->cnt; j++)
+			fprintf(out, "softdep %s %s\n",
+				i->info.modname, tbl->str[j]);
+	}
+	return 1;
+}
+
+/**
+ * output_devname - output device names required by modules
+ *
+ * @modules:	list of modules
+ * @out:	output file reference
+ * @dirname:	output directory
+ *
+ */
+static int output_devname(struct module *modules, FILE *out, char *dirname)
+{
+	struct module *m;
+
+	fprintf(out, "# Device nodes to trigger on-demand module loading.\n");
+	for (m = modules; m != NULL; m = m->next) {
+		const struct module_info *info = &m->info;
+
+		if (info->devname)
+			fprintf(out, "%s %s %c%u:%u\n",
+				info->modname, info->devname, info->devtype,
+				info->major, info->minor);
+	}
+	return 1;
+}
+
+struct depfile {
+	const char *name;
+	int (*func)(struct module *, FILE *, char *dirname);
+	int map_file;
+};
+
+/* The possible output files - those with map_file unset typically not made */
+static const struct depfile depfiles[] = {
+	{ "modules.dep", output_deps, 0 }, /* This is what we check for '-A'. */
+	{ "modules.dep.bin", output_deps_bin, 0 },
+	{ "modules.pcimap", output_pci_table, 1 },
+	{ "modules.usbmap", output_usb_table, 1 },
+	{ "modules.ccwmap", output_ccw_table, 1 },
+	{ "modules.ieee1394map", output_ieee1394_table, 1 },
+	{ "modules.isapnpmap", output_isapnp_table, 1 },
+	{ "modules.inputmap", output_input_table, 1 },
+	{ "modules.ofmap", output_of_table, 1 },
+	{ "modules.seriomap", output_serio_table, 1 },
+	{ "modules.alias", output_aliases, 0 },
+	{ "modules.alias.bin", output_aliases_bin, 0 },
+	{ "modules.softdep", output_softdeps, 0 },
+	{ "modules.symbols", output_symbols, 0 },
+	{ "modules.symbols.bin", output_symbols_bin, 0 },
+	{ "modules.builtin.bin", output_builtin_bin, 0 },
+	{ "modules.devname", output_devname, 0 },
+};
+
+static int wanted_depfile(const struct depfile *d)
+{
+	return !d->map_file || make_map_files || force_map_files;
+}
+
+/* Time taken and bytes written for each of depfiles[] */
+static struct stats_phase depfile_stats[ARRAY_SIZE(depfiles)];
+
+/* Run one of the depfiles[] generators, counting what it costs */
+static int output_depfile(const struct depfile *d, struct module *list,
+			  FILE *out, char *dirname)
+{
+	struct stats_timer t;
+	long start, end;
+	int res;
+
+	start = show_stats ? ftell(out) : -1;
+	stats_start(&t, 1);
+	res = d->func(list, out, dirname);
+	end = show_stats ? ftell(out) : -1;
+	stats_add(&t, &depfile_stats[d - depfiles],
+		  start >= 0 && end > start ? end - start : 0);
+	return res;
+}
+
+/**
+ * write_depfile - write one output file, via a temporary file
+ *
+ * @d:		output to write
+ * @list:	module list
+ * @dirname:	output directory
+ *
+ */
+static void write_depfile(const struct depfile *d, struct module *list,
+			  char *dirname)
+{
+	FILE *out;
+	int res;
+	char depname[strlen(dirname) + 1 + strlen(d->name) + 1];
+	char tmpname[strlen(dirname) + 1 + strlen(d->name) +
+					strlen(".temp") + 1];
+
+	sprintf(depname, "%s/%s", dirname, d->name);
+	sprintf(tmpname, "%s/%s.temp", dirname, d->name);
+	out = fopen(tmpname, "w");
+	if (!out)
+		fatal("Could not open %s for writing: %s\n",
+			tmpname, strerror(errno));
+	res = output_depfile(d, list, out, dirname);
+	fclose(out);
+	if (res) {
+		if (rename(tmpname, depname) < 0)
+			fatal("Could not rename %s into %s: %s\n",
+				tmpname, depname, strerror(errno));
+	} else {
+		if (unlink(tmpname) < 0)
+			warn("Could not delete %s: %s\n",
+				tmpname, strerror(errno));
+	}
+}
+
+/* Output files still to be written, handed out in order */
+struct write_queue
+{
+	pthread_mutex_t lock;
+	unsigned int next;
+	struct module *list;
+	char *dirname;
+};
+
+static void *write_depfiles_thread(void *data)
+{
+	struct write_queue *queue = data;
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		i = queue->next;
+		if (i < ARRAY_SIZE(depfiles))
+			queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (i >= ARRAY_SIZE(depfiles))
+			return NULL;
+		if (wanted_depfile(&depfiles[i]))
+			write_depfile(&depfiles[i], queue->list,
+				      queue->dirname);
+	}
+}
+
+/**
+ * write_depfiles - write all the output files
+ *
+ * @list:	module list
  * @dirname:	output directory
  *
+ * The outputs only read the module list, so they are written by up to
+ * num_threads() threads at once, each into its own temporary file which
+ * is renamed into place when done.  Bar the order of any warnings, it
+ * is the same as writing them one by one.
+ *
+ */
+static void write_depfiles(struct module *list, char *dirname)
+{
+	struct write_queue queue = { PTHREAD_MUTEX_INITIALIZER, 0,
+				     list, dirname };
+	unsigned int threads = num_threads(), count = 0, started, n, i;
+	pthread_t *tids;
+
+	for (i = 0; i < ARRAY_SIZE(depfiles); i++)
+		if (wanted_depfile(&depfiles[i]))
+			count++;
+	if (count > threads)
+		count = threads;
+
+	if (count <= 1) {
+		write_depfiles_thread(&queue);
+		return;
+	}
+
+	/* We are one of the threads; if the others won't start, carry on */
+	tids = NOFAIL(calloc(count - 1, sizeof(*tids)));
+	for (started = 0; started < count - 1; started++)
+		if (pthread_create(&tids[started], NULL,
+				   write_depfiles_thread, &queue) != 0)
+			break;
+	write_depfiles_thread(&queue);
+	for (n = 0; n < started; n++)
+		pthread_join(tids[n], NULL);
+	free(tids);
+}
+
+static void print_stats(struct module *list)
+{
+	unsigned long modules = 0;
+	uint64_t written = 0;
+	unsigned int i;
+
+	if (!show_stats)
+		return;
+
+	for (; list; list = list->next)
+		modules++;
+	for (i = 0; i < NUM_STATS_PHASES; i++)
+		print_stats_phase(stats_phase_names[i], &stats_phases[i]);
+	for (i = 0; i < ARRAY_SIZE(depfiles); i++) {
+		if (!depfile_stats[i].calls)
+			continue;
+		print_stats_phase(depfiles[i].name, &depfile_stats[i]);
+		written += depfile_stats[i].bytes;
+	}
+	fprintf(stderr, "counts modules=%lu cached=%lu symbols=%lu "
+		"lookups=%lu loaded=%llu written=%llu\n",
+		modules, stats.cached, stats.symbols, stats.lookups,
+		(unsigned long long)(stats_phases[STATS_LOAD].bytes
+				     + stats_phases[STATS_DECOMPRESS].bytes),
+		(unsigned long long)written);
+}
+
+/**
+ * any_modules_newer - determine if modules are newer than ref time
+ *
+ * @fd:		open directory to process, closed for us
+ * @mtime:	comparison time
+ *
+ * The worst case is that we process modules we didn't need to. It is
+ * therefore safer to go with "true" if we can't figure it out.
+ *
+ */
+static int any_modules_newer(int fd, time_t mtime)
+{
+	DIR *dir;
+	struct dirent *dirent;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return 1;
+	}
+
+	while ((dirent = readdir(dir)) != NULL) {
+		struct stat st;
+		int isdir, sub;
+
+		if (streq(dirent->d_name, ".") || streq(dirent->d_name, ".."))
+			continue;
+
+		if (smells_like_module(dirent->d_name)) {
+			if (fstatat(dirfd(dir), dirent->d_name, &st,
+				    AT_SYMLINK_NOFOLLOW) != 0
+			    || st.st_mtime > mtime)
+				goto ret_true;
+			continue;
+		}
+
+		isdir = is_dir_entry(dirfd(dir), dirent, 0);
+		if (isdir < 0)
+			goto ret_true;
+		if (isdir) {
+			sub = openat(dirfd(dir), dirent->d_name,
+				     O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (sub < 0 || any_modules_newer(sub, mtime))
+				goto ret_true;
+		}
+	}
+	closedir(dir);
+	return 0;
+
+ret_true:
+	closedir(dir);
+	return 1;
+}
+
+/*
+ * The stamp (modules.stamp)
+ *
+ * Looking at every module's mtime means a stat for each of them, which
+ * is most of what a "depmod -A" at boot costs when nothing has changed.
+ * So after a full run depmod also records modules.dep's mtime, and the
+ * mtime, inode number and link count of every directory below the
+ * module directory.  Adding, removing or renaming a module changes its
+ * directory, so while those all match -A only needs one stat for each
+ * directory.  Anything else (no stamp, a torn one, a different
+ * modules.dep or any directory changed) falls back to the full walk.
+ * A module overwritten in place leaves its directory alone, so isn't
+ * noticed while the stamp matches: run depmod without -A after that.
+ *
+ * The stamp is written last, in place: creating it would change the
+ * module directory's mtime after we had recorded it.
+ */
+#define STAMP_NAME "modules.stamp"
+
+struct stamp_walk
+{
+	FILE *out;
+	unsigned int count;
+	int failed;
+};
+
+/* Record @fd (closed for us) and the directories below it. */
+static void stamp_dir(struct stamp_walk *w, int fd, const char *path)
+{
+	struct stat st;
+	DIR *dir;
+	struct dirent *dirent;
+
+	if (strchr(path, '\n') || fstat(fd, &st) != 0) {
+		close(fd);
+		w->failed = 1;
+		return;
+	}
+	fprintf(w->out, "dir %ld.%09ld %llu %llu %s\n",
+		(long)st.st_mtime, (long)st.st_mtim.tv_nsec,
+		(unsigned long long)st.st_ino,
+		(unsigned long long)st.st_nlink, path);
+	w->count++;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		w->failed = 1;
+		return;
+	}
+	while (!w->failed && (dirent = readdir(dir)) != NULL) {
+		char *subpath;
+		int isdir, sub;
+
+		if (streq(dirent->d_name, ".") || streq(dirent->d_name, ".."))
+			continue;
+
+		isdir = is_dir_entry(dirfd(dir), dirent, 0);
+		if (isdir == 0)
+			continue;
+		sub = isdir < 0 ? -1 : openat(dirfd(dir), dirent->d_name,
+					O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (sub < 0) {
+			w->failed = 1;
+			break;
+		}
+		if (streq(path, "."))
+			subpath = NOFAIL(strdup(dirent->d_name));
+		else
+			nofail_asprintf(&subpath, "%s/%s", path,
+					dirent->d_name);
+		stamp_dir(w, sub, subpath);
+		free(subpath);
+	}
+	closedir(dir);
+}
+
+static void write_stamp(const char *dirname)
+{
+	struct stamp_walk w = { NULL, 0, 0 };
+	char *name, *depfile;
+	struct stat st;
+	int fd;
+
+	nofail_asprintf(&name, "%s/%s", dirname, STAMP_NAME);
+	nofail_asprintf(&depfile, "%s/%s", dirname, depfiles[0].name);
+
+	w.out = fopen(name, "a");
+	if (w.out)
+		fclose(w.out);
+
+	if (stat(depfile, &st) != 0)
+		goto out;
+	fd = open(dirname, O_RDONLY | O_DIRECTORY, 0);
+	if (fd < 0)
+		goto out;
+	w.out = fopen(name, "w");
+	if (!w.out) {
+		warn("Could not open %s for writing: %s\n",
+		     name, strerror(errno));
+		close(fd);
+		goto out;
+	}
+
+	fprintf(w.out, "# modules.dep's mtime, then each directory's mtime, "
+		"inode, links and name\n");
+	fprintf(w.out, "dep %ld.%09ld\n",
+		(long)st.st_mtime, (long)st.st_mtim.tv_nsec);
+	stamp_dir(&w, fd, ".");
+	if (!w.failed)
+		fprintf(w.out, "end %u\n", w.count);
+	if (fclose(w.out) != 0)
+		warn("Could not write %s: %s\n", name, strerror(errno));
+	if (w.failed)
+		unlink(name);
+out:
+	free(depfile);
+	free(name);
+}
+
+/**
+ * stamp_out_of_date - check the module directories against the stamp
+ *
+ * @dirname:	directory to process
+ * @fd:		open @dirname, left open
+ * @dep:	stat of modules.dep
+ *
+ * Returns 0 if modules.dep and every directory are as the stamp
+ * recorded them, otherwise 1 (including if there is no usable stamp).
+ *
+ */
+static int stamp_out_of_date(const char *dirname, int fd,
+			     const struct stat *dep)
+{
+	char *name, *line = NULL;
+	size_t size = 0;
+	unsigned int count = 0, end;
+	int have_dep = 0, stale = 1;
+	FILE *in;
+
+	nofail_asprintf(&name, "%s/%s", dirname, STAMP_NAME);
+	in = fopen(name, "r");
+	free(name);
+	if (!in)
+		return 1;
+
+	while (getline(&line, &size, in) > 0) {
+		unsigned long long ino, nlink;
+		long sec, nsec;
+		struct stat st;
+		int n;
+
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '#')
+			continue;
+
+		if (sscanf(line, "dep %ld.%ld", &sec, &nsec) == 2) {
+			if (sec != dep->st_mtime
+			    || nsec != dep->st_mtim.tv_nsec)
+				break;
+			have_dep = 1;
+		} else if (sscanf(line, "dir %ld.%ld %llu %llu%n",
+				  &sec, &nsec, &ino, &nlink, &n) == 4
+			   && line[n] == ' ') {
+			if (fstatat(fd, line + n + 1, &st,
+				    AT_SYMLINK_NOFOLLOW) != 0
+			    || !S_ISDIR(st.st_mode)
+			    || sec != st.st_mtime
+			    || nsec != st.st_mtim.tv_nsec
+			    || ino != st.st_ino
+			    || nlink != st.st_nlink)
+				break;
+			count++;
+		} else {
+			if (sscanf(line, "end %u", &end) == 1
+			    && end == count && have_dep)
+				stale = 0;
+			break;
+		}
+	}
+	free(line);
+	fclose(in);
+	return stale;
+}
+
+/**
+ * depfile_out_of_date - check if module dep files are older than any modules
+ *
+ * @dirname:	directory to process
+ *
+ * Use the stamp if it is up to date, otherwise any_modules_newer, to
+ * determine if the dep files are up to date.
+ *
+ */
+static int depfile_out_of_date(const char *dirname)
+{
+	struct stat st;
+	char depfile[strlen(dirname) + 1 + strlen(depfiles[0].name) + 1];
+	int fd;
+
+	sprintf(depfile, "%s/%s", dirname, depfiles[0].name);
+
+	if (stat(depfile, &st) != 0)
+		return 1;
+
+	fd = open(dirname, O_RDONLY | O_DIRECTORY, 0);
+	if (fd < 0)
+		return 1;
+	if (!stamp_out_of_date(dirname, fd, &st)) {
+		close(fd);
+		return 0;
+	}
+	return any_modules_newer(fd, st.st_mtime);
+}
+
+/*
+ * Incremental updates (depmod -i)
+ *
+ * Installing one module should not mean reading every other module again.
+ * With -i, depmod loads modules.dep.bin, modules.alias.bin and
+ * modules.symbols.bin, replaces the entries of the modules named on the
+ * command line, and recalculates the deps of those modules and of the
+ * modules which depended on the versions they replace.  Everything else
+ * is taken from the indexes as it stands.
+ *
+ * The result has to be what "depmod -a" would write, so whenever that
+ * can't be worked out from the indexes alone we do the full run instead:
+ * if a module exports a symbol that the module it replaces did not (the
+ * indexes don't say which modules were missing it), if a symbol has two
+ * exporters or a key would have two values of the same priority (the
+ * outcome then depends on directory order), or if a dependency loop
+ * appears.
+ *
+ * The text files are updated to match, by replacing the lines of the
+ * changed modules.  Those of other modules are copied over in the order
+ * given by modules.dep, which must agree with modules.dep.bin.  A module
+ * not in modules.order goes last, where a scan would usually find one
+ * installed since; its exact place among such modules depends on
+ * directory order.  We assume nothing else has changed since the files
+ * were written, including the configuration and modules.order.
  */
-static int output_builtin_bin(struct module *unused, FILE *out, char *dirname)
+
+struct inc_module {
+	char *modname;		/* key in modules.dep.bin */
+	const char *line;	/* value in modules.dep.bin, NULL if new */
+	char *relpath;		/* as written in modules.dep */
+	char *oldpath;		/* relpath of the version being replaced */
+	unsigned int order;
+	struct module *mod;	/* stand-in without a file if not changed */
+
+	int changed;		/* deps must be recalculated */
+	int moved;		/* new, or moved in modules.order */
+	char *newline;		/* new value in modules.dep.bin, if changed */
+	unsigned int position;	/* in the text files, once updated */
+	unsigned int text_start, text_count;	/* its lines in a text file */
+
+	/* Dependency list, split from line or recalculated */
+	int state;		/* 1 while recalculating, 2 when known */
+	unsigned int num_deps;
+	const char **deps;
+	char *copy;		/* of line, split up */
+};
+
+struct inc_state {
+	const char *dirname;
+	struct index_node *deps, *aliases, *symbols;
+	struct inc_module *mods;	/* sorted by modname */
+	unsigned int count, alloc;
+	int duplicates;			/* a key of modules.dep.bin with two values */
+	struct module *ambiguous;	/* owner of symbols with two exporters */
+};
+
+static int inc_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct inc_module *)a)->modname,
+		      ((const struct inc_module *)b)->modname);
+}
+
+static struct inc_module *inc_find(struct inc_state *st, const char *modname)
+{
+	struct inc_module key = { .modname = (char *) modname };
+
+	return bsearch(&key, st->mods, st->count, sizeof(key), inc_cmp);
+}
+
+/* Add a module with no entry yet.  The table must be sorted afterwards. */
+static struct inc_module *inc_new(struct inc_state *st, const char *modname)
+{
+	struct inc_module *m;
+
+	if (st->count == st->alloc) {
+		st->alloc = st->alloc ? st->alloc * 2 : 256;
+		st->mods = NOFAIL(realloc(st->mods,
+					  st->alloc * sizeof(*st->mods)));
+	}
+	m = &st->mods[st->count++];
+	memset(m, 0, sizeof(*m));
+	m->modname = NOFAIL(strdup(modname));
+	m->order = INDEX_PRIORITY_MIN;
+	return m;
+}
+
+static void inc_add_line(const char *key, const struct index_value *values,
+			 void *data)
+{
+	struct inc_state *st = data;
+	struct inc_module *m = inc_new(st, key);
+
+	if (values->next)
+		st->duplicates = 1;
+	m->line = values->value;
+	m->order = values->priority;
+	m->relpath = NOFAIL(strndup(m->line, strcspn(m->line, ":")));
+}
+
+static void inc_abspath(const struct inc_state *st, const char *relpath,
+			char *buf)
+{
+	if (relpath[0] == '/')
+		strcpy(buf, relpath);
+	else
+		sprintf(buf, "%s/%s", st->dirname, relpath);
+}
+
+/* Find the file for a module of the indexes, if it has none yet */
+static struct module *inc_stand_in(struct inc_state *st, struct inc_module *m)
+{
+	struct module *new;
+
+	if (m->mod)
+		return m->mod;
+
+	new = NOFAIL(calloc(sizeof(*new) + strlen(st->dirname) + 1
+			    + strlen(m->relpath) + 1, 1));
+	inc_abspath(st, m->relpath, new->pathname);
+	new->basename = my_basename(new->pathname);
+	new->order = m->order;
+	m->mod = new;
+	return new;
+}
+
+static struct inc_module *inc_owner(struct inc_state *st, struct module *mod)
+{
+	char modname[strlen(mod->pathname) + 1];
+
+	filename2modname(modname, mod->pathname);
+	return inc_find(st, modname);
+}
+
+/**
+ * inc_in_tree - would "depmod -a" find this module?
+ *
+ * @dirname:	top-level directory
+ * @path:	module path given on the command line
+ *
+ */
+static int inc_in_tree(const char *dirname, const char *path)
+{
+	size_t len = strlen(dirname);
+	const char *p;
+
+	if (strncmp(path, dirname, len) != 0 || path[len] != '/')
+		return 0;
+
+	for (p = path + len; *p == '/'; p += len) {
+		p++;
+		len = strcspn(p, "/");
+		if (len == 0
+		    || (len == 1 && strncmp(p, ".", 1) == 0)
+		    || (len == 2 && strncmp(p, "..", 2) == 0))
+			return 0;
+		if (p[len] == '/'
+		    && ((len == 6 && strncmp(p, "source", 6) == 0)
+			|| (len == 5 && strncmp(p, "build", 5) == 0)))
+			return 0;
+	}
+	return smells_like_module(my_basename(path));
+}
+
+/* Line number in modules.order, as sort_modules() would give it */
+static unsigned int inc_order(const char *dirname, const char *relpath)
+{
+	char file_name[strlen(dirname) + strlen("/modules.order") + 1];
+	char line[10240];
+	unsigned int linenum = 0;
+	FILE *modorder;
+
+	sprintf(file_name, "%s/modules.order", dirname);
+	modorder = fopen(file_name, "r");
+	if (!modorder)
+		return INDEX_PRIORITY_MIN;
+
+	while (fgets(line, sizeof(line), modorder)) {
+		int len = strlen(line);
+
+		linenum++;
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (streq(line, relpath)) {
+			fclose(modorder);
+			return linenum;
+		}
+	}
+	fclose(modorder);
+	return INDEX_PRIORITY_MIN;
+}
+
+/**
+ * inc_add_module - take a module from the command line
+ *
+ * @st:		update state
+ * @mod:	the module
+ * @search:	path search order
+ * @overrides:	module override directives
+ *
+ * Returns 0 if the indexes can't be updated for it.
+ */
+static int inc_add_module(struct inc_state *st, struct module *mod,
+			  struct module_search *search,
+			  struct module_overrides *overrides)
+{
+	const char *relpath = compress_path(mod->pathname, st->dirname);
+	char modname[strlen(mod->pathname) + 1];
+	struct inc_module *m;
+	unsigned int order;
+
+	if (!inc_in_tree(st->dirname, mod->pathname)) {
+		info("%s is not in %s\n", mod->pathname, st->dirname);
+		return 0;
+	}
+
+	filename2modname(modname, mod->pathname);
+	m = inc_find(st, modname);
+	if (m && m->changed) {
+		info("%s is given twice\n", modname);
+		return 0;
+	}
+
+	if (m && !streq(m->relpath, relpath)) {
+		/* Another module of the same name: which would a scan keep? */
+		char oldpath[strlen(st->dirname) + 1 + strlen(m->relpath) + 1];
+		int newer, older;
+
+		inc_abspath(st, m->relpath, oldpath);
+		if (!streq(my_basename(oldpath), mod->basename)) {
+			info("%s and %s have the same name\n",
+			     mod->pathname, oldpath);
+			return 0;
+		}
+		newer = is_higher_priority(mod->pathname, oldpath,
+					   search, overrides);
+		older = is_higher_priority(oldpath, mod->pathname,
+					   search, overrides);
+		if (newer == older) {
+			info("%s and %s have the same priority\n",
+			     mod->pathname, oldpath);
+			return 0;
+		}
+		if (older) {
+			info("%s is overridden by %s\n", mod->pathname,
+			     oldpath);
+			return 1;
+		}
+	}
+
+	if (m)
+		m->oldpath = m->relpath;
+	else {
+		m = inc_new(st, modname);
+		qsort(st->mods, st->count, sizeof(*st->mods), inc_cmp);
+		m = inc_find(st, modname);
+	}
+	m->relpath = NOFAIL(strdup(relpath));
+	order = inc_order(st->dirname, relpath);
+	m->moved = !m->line || m->order != order;
+	m->order = order;
+	mod->order = m->order;
+	read_module(mod);
+	m->mod = mod;
+	m->changed = 1;
+	return 1;
+}
+
+/* Read a module which depended on a changed one */
+static int inc_grab(struct inc_state *st, struct inc_module *m)
+{
+	char path[strlen(st->dirname) + 1 + strlen(m->relpath) + 1];
+
+	inc_abspath(st, m->relpath, path);
+	m->mod = grab_module(NULL, path);
+	if (!m->mod)
+		return 0;
+	m->mod->order = m->order;
+	read_module(m->mod);
+	m->changed = 1;
+	return 1;
+}
+
+/* Keys which have a given value */
+struct inc_keys {
+	const char *value;
+	unsigned int count;
+	char **keys;
+};
+
+static void inc_add_key(const char *key, const struct index_value *values,
+			void *data)
+{
+	struct inc_keys *k = data;
+	const struct index_value *v;
+
+	for (v = values; v; v = v->next) {
+		if (streq(v->value, k->value)) {
+			k->keys = NOFAIL(realloc(k->keys, (k->count + 1)
+						 * sizeof(char *)));
+			k->keys[k->count++] = NOFAIL(strdup(key));
+			return;
+		}
+	}
+}
+
+static int inc_cmpkey(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Remove a value from every key, returning the keys it was found under */
+static void inc_remove_value(struct index_node *index, const char *value,
+			     struct inc_keys *k)
+{
+	unsigned int i;
+
+	k->value = value;
+	k->count = 0;
+	k->keys = NULL;
+	index_foreach(index, inc_add_key, k);
+	for (i = 0; i < k->count; i++)
+		index_remove(index, k->keys[i], value);
+}
+
+static void inc_free_keys(struct inc_keys *k)
+{
+	while (k->count)
+		free(k->keys[--k->count]);
+	free(k->keys);
+}
+
+/* Does a key of value's have another value of the same priority? */
+static void inc_check_tie(const char *key, const struct index_value *values,
+			  void *data)
+{
+	struct inc_keys *k = data;
+	const struct index_value *v, *w;
+
+	for (v = values; v; v = v->next) {
+		if (!streq(v->value, k->value))
+			continue;
+		for (w = values; w; w = w->next) {
+			if (w->priority == v->priority
+			    && !streq(w->value, k->value)) {
+				info("alias %s of %s is ambiguous\n",
+				     key, k->value);
+				k->count++;
+				return;
+			}
+		}
+	}
+}
+
+/**
+ * inc_update_aliases - replace the aliases of a changed module
+ *
+ * @st:		update state
+ * @m:		changed module
+ *
+ */
+static int inc_update_aliases(struct inc_state *st, struct inc_module *m)
+{
+	struct inc_keys k;
+
+	inc_remove_value(st->aliases, m->modname, &k);
+	inc_free_keys(&k);
+
+	index_aliases(st->aliases, m->mod);
+
+	/* Another value of the same priority would be ordered by the
+	   order modules were found in */
+	k.count = 0;
+	index_foreach(st->aliases, inc_check_tie, &k);
+	return k.count == 0;
+}
+
+/**
+ * inc_update_symbols - replace the exported symbols of a changed module
+ *
+ * @st:		update state
+ * @m:		changed module
+ *
+ */
+static int inc_update_symbols(struct inc_state *st, struct inc_module *m)
+{
+	struct string_table *syms = m->mod->exports;
+	struct inc_keys old;
+	char **keys;
+	int i, ok = 1;
+
+	inc_remove_value(st->symbols, m->modname, &old);
+
+	keys = NOFAIL(calloc(syms ? syms->cnt : 0, sizeof(char *)));
+	for (i = 0; syms && i < syms->cnt && ok; i++) {
+		const struct index_value *v;
+
+		nofail_asprintf(&keys[i], "symbol:%s",
+				skip_symprefix(syms->str[i]));
+		if (!bsearch(&keys[i], old.keys, old.count, sizeof(char *),
+			     inc_cmpkey)) {
+			info("%s exports new symbol %s\n", m->modname,
+			     keys[i] + strlen("symbol:"));
+			ok = 0;
+		}
+		for (v = index_lookup(st->symbols, keys[i]); v; v = v->next) {
+			info("%s is exported by %s and %s\n",
+			     keys[i] + strlen("symbol:"), v->value,
+			     m->modname);
+			ok = 0;
+		}
+	}
+	for (i = 0; syms && i < syms->cnt; i++) {
+		if (ok)
+			index_insert(st->symbols, keys[i], m->modname,
+				     m->order);
+		free(keys[i]);
+	}
+	free(keys);
+	inc_free_keys(&old);
+	return ok;
+}
+
+/* Does a modules.dep.bin line list the module at path? */
+static int inc_line_has(const char *line, const char *path)
+{
+	size_t len = strlen(path);
+	const char *p = strchr(line, ':');
+
+	while (p && (p = strstr(p, path)) != NULL) {
+		if (p[-1] == ' ' && (p[len] == ' ' || p[len] == '\0'))
+			return 1;
+		p += len;
+	}
+	return 0;
+}
+
+static void inc_push_dep(const char ***list, unsigned int *count,
+			 const char *path)
+{
+	*list = NOFAIL(realloc(*list, (*count + 1) * sizeof(char *)));
+	(*list)[(*count)++] = path;
+}
+
+/* Split the line of an unchanged module into its dependency list */
+static void inc_split_line(struct inc_module *m)
+{
+	char *p;
+
+	if (m->state)
+		return;
+	m->state = 2;
+	m->copy = NOFAIL(strdup(strchr(m->line, ':') + 1));
+	for (p = strtok(m->copy, " "); p; p = strtok(NULL, " "))
+		inc_push_dep(&m->deps, &m->num_deps, p);
+}
+
+/**
+ * inc_deps - work out the new dependency list of a changed module
+ *
+ * @st:		update state
+ * @m:		changed module
+ *
+ * This is what order_dep_list() gives: each dependency followed by
+ * its own list, keeping only the last of any repeats.  The lists of
+ * unchanged modules are read from their lines.  Returns 0 on a loop.
+ */
+static int inc_deps(struct inc_state *st, struct inc_module *m)
+{
+	const char **all = NULL;
+	unsigned int count = 0;
+	unsigned int i, j;
+
+	if (m->state == 2)
+		return 1;
+	if (m->state == 1) {
+		info("%s is in a dependency loop\n", m->modname);
+		return 0;
+	}
+	m->state = 1;
+
+	for (i = 0; i < m->mod->num_deps; i++) {
+		struct inc_module *dep = inc_owner(st, m->mod->deps[i]);
+
+		if (dep->changed) {
+			if (!inc_deps(st, dep))
+				return 0;
+		} else
+			inc_split_line(dep);
+
+		inc_push_dep(&all, &count, dep->relpath);
+		for (j = 0; j < dep->num_deps; j++)
+			inc_push_dep(&all, &count, dep->deps[j]);
+	}
+
+	/* Keep the last of each, working backwards */
+	m->deps = NOFAIL(malloc((count + 1) * sizeof(char *)));
+	m->num_deps = 0;
+	for (i = count; i-- > 0; ) {
+		for (j = 0; j < m->num_deps; j++)
+			if (streq(m->deps[j], all[i]))
+				break;
+		if (j == m->num_deps)
+			m->deps[m->num_deps++] = all[i];
+	}
+	free(all);
+
+	for (i = 0; i < m->num_deps / 2; i++) {
+		const char *tmp = m->deps[i];
+
+		m->deps[i] = m->deps[m->num_deps - 1 - i];
+		m->deps[m->num_deps - 1 - i] = tmp;
+	}
+
+	for (i = 0; i < m->num_deps; i++) {
+		if (streq(m->deps[i], m->relpath)) {
+			info("%s is in a dependency loop\n", m->modname);
+			return 0;
+		}
+	}
+	m->state = 2;
+	return 1;
+}
+
+/* Give each exported symbol of the indexes an owner, for calculate_deps() */
+static void inc_add_symbol(const char *key, const struct index_value *values,
+			   void *data)
+{
+	struct inc_state *st = data;
+	struct inc_module *m;
+	struct module *owner = st->ambiguous;
+
+	if (!strstarts(key, "symbol:"))
+		return;
+
+	m = inc_find(st, values->value);
+	if (m && !values->next)
+		owner = inc_stand_in(st, m);
+	add_symbol(key + strlen("symbol:"), 0, owner);
+}
+
+/* Drop the symbols of modules, keeping those of the kernel */
+static void forget_module_symbols(void)
 {
+	struct symbol *old = symbols;
+	unsigned int i, count = num_symbols;
+
+	symbols = NULL;
+	num_symbols = max_symbols = num_symbol_names = 0;
+	memset(symbol_table, 0, symbol_table_size * sizeof(*symbol_table));
+
+	for (i = 0; i < count; i++)
+		if (!old[i].owner)
+			add_symbol(old[i].name, old[i].ver, NULL);
+	free(old);
+}
+
+static struct index_node *inc_load(const char *dirname, const char *name)
+{
+	char filename[strlen(dirname) + 1 + strlen(name) + 1];
+	struct index_file *in;
 	struct index_node *index;
-	char *textfile, *line;
-	unsigned int linenum;
-	FILE *f;
 
-	nofail_asprintf(&textfile, "%s/modules.builtin", dirname);
-	if (!(f = fopen(textfile, "r"))) {
-		if (errno != ENOENT)
-			fatal("Could not open '%s': %s\n",
-					textfile, strerror(errno));
-		free(textfile);
+	sprintf(filename, "%s/%s", dirname, name);
+	in = index_file_open(filename);
+	if (!in) {
+		info("Could not load %s\n", filename);
+		return NULL;
+	}
+	index = index_file_load(in);
+	index_file_close(in);
+	return index;
+}
+
+static void inc_write(const char *dirname, const char *name,
+		      struct index_node *index, int hashed)
+{
+	char tmpname[strlen(dirname) + 1 + strlen(name) + strlen(".temp") + 1];
+	FILE *out;
+
+	sprintf(tmpname, "%s/%s.temp", dirname, name);
+	out = fopen(tmpname, "w");
+	if (!out)
+		fatal("Could not open %s for writing: %s\n",
+			tmpname, strerror(errno));
+	if (hashed)
+		index_write_hashed(index, out);
+	else
+		index_write(index, out);
+	fclose(out);
+}
+
+static void inc_rename(const char *dirname, const char *name)
+{
+	char depname[strlen(dirname) + 1 + strlen(name) + 1];
+	char tmpname[strlen(dirname) + 1 + strlen(name) + strlen(".temp") + 1];
+
+	sprintf(depname, "%s/%s", dirname, name);
+	sprintf(tmpname, "%s/%s.temp", dirname, name);
+	if (rename(tmpname, depname) < 0)
+		fatal("Could not rename %s into %s: %s\n",
+			tmpname, depname, strerror(errno));
+}
+
+/* The text files, which -i updates to match the indexes */
+static int inc_text_file(const struct depfile *d)
+{
+	return wanted_depfile(d) && !ends_in(d->name, ".bin");
+}
+
+static void inc_unlink(const char *dirname, const char *name)
+{
+	char tmpname[strlen(dirname) + 1 + strlen(name) + strlen(".temp") + 1];
+
+	sprintf(tmpname, "%s/%s.temp", dirname, name);
+	unlink(tmpname);
+}
+
+/* One of the text files, split into lines */
+struct inc_text {
+	char **lines;		/* each with its newline */
+	unsigned int count;
+	unsigned int header;	/* leading comment lines */
+};
+
+static int inc_read_text(const char *dirname, const char *name,
+			 struct inc_text *t)
+{
+	char filename[strlen(dirname) + 1 + strlen(name) + 1];
+	char *line = NULL;
+	size_t size = 0;
+	FILE *in;
+
+	memset(t, 0, sizeof(*t));
+	sprintf(filename, "%s/%s", dirname, name);
+	in = fopen(filename, "r");
+	if (!in) {
+		info("Could not load %s\n", filename);
+		return 0;
+	}
+	while (getline(&line, &size, in) > 0) {
+		t->lines = NOFAIL(realloc(t->lines, (t->count + 1)
+					  * sizeof(char *)));
+		t->lines[t->count++] = NOFAIL(strdup(line));
+		if (t->header == t->count - 1 && line[0] == '#')
+			t->header++;
+	}
+	free(line);
+	fclose(in);
+	return 1;
+}
+
+static void inc_free_text(struct inc_text *t)
+{
+	while (t->count)
+		free(t->lines[--t->count]);
+	free(t->lines);
+}
+
+/*
+ * The module a line of a text file is for.  modules.dep lines start with
+ * its path, map lines with its name; aliases and symbols end with it.
+ */
+static struct inc_module *inc_line_owner(struct inc_state *st,
+					 const char *name, const char *line)
+{
+	char field[strlen(line) + 1], modname[strlen(line) + 1];
+	const char *p = line;
+	size_t len;
+
+	if (streq(name, "modules.dep"))
+		len = strcspn(p, ":");
+	else if (streq(name, "modules.alias")
+		 || streq(name, "modules.symbols")) {
+		len = strcspn(p, "\n");
+		while (len && p[len - 1] == ' ')
+			len--;
+		p = memrchr(line, ' ', len);
+		if (!p)
+			return NULL;
+		len -= ++p - line;
+	} else {
+		if (streq(name, "modules.softdep"))
+			p += strcspn(p, " ") + 1;
+		len = strcspn(p, " \n");
+	}
+	memcpy(field, p, len);
+	field[len] = '\0';
+	filename2modname(modname, field);
+	return inc_find(st, modname);
+}
+
+/**
+ * inc_text_order - the order the modules come in the text files
+ *
+ * @st:		update state
+ * @order:	filled in with the modules, as a full run would list them
+ *
+ * Unchanged modules keep their places in modules.dep, as do changed ones
+ * still at the same line of modules.order.  Others go where their line of
+ * modules.order puts them, or after the rest if they have none.  Returns
+ * the number of modules, or 0 if modules.dep doesn't match the index.
+ */
+static unsigned int inc_text_order(struct inc_state *st,
+				   struct inc_module **order)
+{
+	struct inc_text t;
+	struct inc_module *m;
+	unsigned int i, j, n = 0, lines = 0;
+
+	if (!inc_read_text(st->dirname, "modules.dep", &t))
 		return 0;
+	for (i = 0; i < st->count; i++) {
+		st->mods[i].text_count = 0;
+		if (st->mods[i].line)
+			lines++;
 	}
-	free(textfile);
-	index = index_create();
-
-	while ((line = getline_wrapped(f, &linenum)) != NULL) {
-		char *module = line;
+	for (i = t.header; i < t.count; i++) {
+		m = inc_line_owner(st, "modules.dep", t.lines[i]);
+		if (!m || !m->line || m->text_count
+		    || strncmp(t.lines[i], m->line, strlen(m->line)) != 0
+		    || !streq(t.lines[i] + strlen(m->line), "\n"))
+			goto mismatch;
+		m->text_count = 1;
+		if (!(m->changed && m->moved))
+			order[n++] = m;
+	}
+	if (t.count - t.header != lines)
+		goto mismatch;
+	inc_free_text(&t);
 
-		if (!*line || *line == '#') {
-			free(line);
+	for (i = 0; i < st->count; i++) {
+		m = &st->mods[i];
+		if (!m->changed || !m->moved)
 			continue;
-		}
-		filename2modname(module, module);
-		index_insert(index, module, "", 0);
-		free(line);
+		for (j = 0; j < n; j++)
+			if (m->order != INDEX_PRIORITY_MIN
+			    && order[j]->order > m->order)
+				break;
+		memmove(&order[j + 1], &order[j], (n - j) * sizeof(*order));
+		order[j] = m;
+		n++;
 	}
-	fclose(f);
-	index_write(index, out);
-	index_destroy(index);
+	for (i = 0; i < n; i++)
+		order[i]->position = i;
+	return n;
 
-	return 1;
+mismatch:
+	info("modules.dep does not match modules.dep.bin\n");
+	inc_free_text(&t);
+	return 0;
 }
 
-/**
- * output_aliases - output list of module aliases
- *
- * @modules:	list of modules
- * @out:	output file reference
- * @dirname:	output directory
- *
- */
-static int output_aliases(struct module *modules, FILE *out, char *dirname)
+/* A line of modules.symbols, and where output_symbols() would put it */
+struct inc_symbol {
+	unsigned int bucket;	/* see symbol_output_cmp() */
+	unsigned int position;	/* of its module */
+	unsigned int sub;	/* among its module's symbols, newest first */
+	char *line;
+	int made;		/* rather than taken from the old file */
+};
+
+static int inc_symbol_cmp(const void *a, const void *b)
 {
-	struct module *i;
-	struct elf_file *file;
-	struct string_table *tbl;
-	int j;
+	const struct inc_symbol *x = a, *y = b;
 
-	fprintf(out, "# Aliases extracted from modules themselves.\n");
-	for (i = modules; i; i = i->next) {
-		char modname[strlen(i->pathname)+1];
+	if (x->bucket != y->bucket)
+		return x->bucket < y->bucket ? -1 : 1;
+	if (x->position != y->position)
+		return x->position > y->position ? -1 : 1;
+	return x->sub < y->sub ? -1 : x->sub > y->sub;
+}
 
-		file = i->file;
-		filename2modname(modname, i->pathname);
+static unsigned int inc_symbol_bucket(const char *line)
+{
+	const char *name = line + strlen("alias symbol:");
+	size_t len = strcspn(name, " ");
+	char sym[len + 1];
 
-		/* Grab from old-style .modalias section. */
-		tbl = file->ops->load_strings(file, ".modalias", NULL);
-		for (j = 0; tbl && j < tbl->cnt; j++)
-			fprintf(out, "alias %s %s\n", tbl->str[j], modname);
-		strtbl_free(tbl);
-
-		/* Grab from new-style .modinfo section. */
-		tbl = file->ops->load_strings(file, ".modinfo", NULL);
-		for (j = 0; tbl && j < tbl->cnt; j++) {
-			const char *p = tbl->str[j];
-			if (strstarts(p, "alias="))
-				fprintf(out, "alias %s %s\n",
-					p + strlen("alias="), modname);
-		}
-		strtbl_free(tbl);
-	}
-	return 1;
+	memcpy(sym, name, len);
+	sym[len] = '\0';
+	return tdb_hash(sym) % OLD_SYMBOL_HASH_SIZE;
 }
 
 /**
- * output_aliases_bin - output list of module aliases in binary format
+ * inc_write_symbols - write modules.symbols in the order of a full run
  *
- * @modules:	list of modules
- * @out:	outout file reference
- * @dirname:	output directory
+ * @st:		update state
+ * @t:		the old file
+ * @out:	where to write the new one
  *
+ * Symbols come in hash bucket order, and newest first within a bucket,
+ * ie. by their modules' places, last first.  The lines of unchanged
+ * modules keep their order within each bucket; those of changed modules
+ * are made from what they export now.
  */
-static int output_aliases_bin(struct module *modules, FILE *out, char *dirname)
+static void inc_write_symbols(struct inc_state *st, const struct inc_text *t,
+			      FILE *out)
 {
-	struct module *i;
-	struct elf_file *file;
-	struct string_table *tbl;
-	int j;
-	char *alias;
-	struct index_node *index;
-	int duplicate;
+	struct inc_symbol *syms;
+	struct inc_module *m;
+	unsigned int i, n = 0, max = t->count - t->header;
+
+	for (i = 0; i < st->count; i++)
+		if (st->mods[i].changed && st->mods[i].mod->exports)
+			max += st->mods[i].mod->exports->cnt;
+	syms = NOFAIL(calloc(max ?: 1, sizeof(*syms)));
+
+	for (i = t->header; i < t->count; i++) {
+		m = inc_line_owner(st, "modules.symbols", t->lines[i]);
+		if (m->changed)
+			continue;
+		syms[n].bucket = inc_symbol_bucket(t->lines[i]);
+		syms[n].position = m->position;
+		syms[n].sub = i;
+		syms[n++].line = t->lines[i];
+	}
+	for (i = 0; i < st->count; i++) {
+		struct string_table *exports;
+		int j;
 
-	index = index_create();
-	
-	for (i = modules; i; i = i->next) {
-		char modname[strlen(i->pathname)+1];
+		m = &st->mods[i];
+		exports = m->mod ? m->mod->exports : NULL;
+		if (!m->changed)
+			continue;
+		for (j = 0; exports && j < exports->cnt; j++) {
+			nofail_asprintf(&syms[n].line, "alias symbol:%s %s\n",
+					skip_symprefix(exports->str[j]),
+					m->modname);
+			syms[n].bucket = inc_symbol_bucket(syms[n].line);
+			syms[n].position = m->position;
+			syms[n].sub = exports->cnt - j;
+			syms[n++].made = 1;
+		}
+	}
 
-		file = i->file;
-		filename2modname(modname, i->pathname);
+	qsort(syms, n, sizeof(*syms), inc_symbol_cmp);
+	for (i = 0; i < n; i++) {
+		fputs(syms[i].line, out);
+		if (syms[i].made)
+			free(syms[i].line);
+	}
+	free(syms);
+}
 
-		/* Grab from old-style .modalias section. */
-		tbl = file->ops->load_strings(file, ".modalias", NULL);
-		for (j = 0; tbl && j < tbl->cnt; j++) {
-			alias = NOFAIL(strdup(tbl->str[j]));
-			underscores(alias);
-			duplicate = index_insert(index, alias, modname, i->order);
-			if (duplicate && warn_dups)
-				warn("duplicate module alias:\n%s %s\n",
-					alias, modname);
-			free(alias);
-		}
-		strtbl_free(tbl);
-
-		/* Grab from new-style .modinfo section. */
-		tbl = file->ops->load_strings(file, ".modinfo", NULL);
-		for (j = 0; tbl && j < tbl->cnt; j++) {
-			const char *p = tbl->str[j];
-			if (strstarts(p, "alias=")) {
-				alias = NOFAIL(strdup(p + strlen("alias=")));
-				underscores(alias);
-				duplicate = index_insert(index, alias, modname, i->order);
-				if (duplicate && warn_dups)
-					warn("duplicate module alias:\n%s %s\n",
-						alias, modname);
-				free(alias);
-			}
-		}
-		strtbl_free(tbl);
+/* What one of depfiles[] would write for just this module */
+static void inc_module_text(const struct depfile *d, struct inc_module *m,
+			    FILE *out, char *dirname)
+{
+	struct module *next = m->mod->next;
+	char *buf = NULL, *p, *end;
+	size_t len = 0;
+	FILE *mem;
+
+	if (streq(d->name, "modules.dep")) {
+		fprintf(out, "%s\n", m->newline);
+		return;
 	}
-	
-	index_write(index, out);
-	index_destroy(index);
 
-	return 1;
+	mem = NOFAIL(open_memstream(&buf, &len));
+	m->mod->next = NULL;
+	d->func(m->mod, mem, dirname);
+	m->mod->next = next;
+	fclose(mem);
+
+	/* Leaving out the header */
+	for (p = buf; p < buf + len; p = end) {
+		end = memchr(p, '\n', buf + len - p);
+		end = end ? end + 1 : buf + len;
+		if (*p != '#')
+			fwrite(p, 1, end - p, out);
+	}
+	free(buf);
 }
 
 /**
- * output_softdeps - output module softdeps (non-implicit dependencies)
+ * inc_write_text - update one of the text files for the changed modules
  *
- * @modules:	list of modules
- * @out:	output file reference
- * @dirname:	output directory
+ * @st:		update state
+ * @d:		the file
+ * @order:	modules, from inc_text_order()
+ * @n:		how many
+ * @dirname:	top-level directory
  *
+ * The lines of each unchanged module are copied over, and those of
+ * changed modules written afresh.  modules.symbols is in symbol hash
+ * order rather than module order, so it is sorted again.  Writes the
+ * ".temp" file, or returns 0 if the old one doesn't parse.
  */
-static int output_softdeps(struct module *modules, FILE *out, char *dirname)
+static int inc_write_text(struct inc_state *st, const struct depfile *d,
+			  struct inc_module **order, unsigned int n,
+			  char *dirname)
 {
-	struct module *i;
-	struct elf_file *file;
-	struct string_table *tbl;
-	int j;
-
-	fprintf(out, "# Soft dependencies extracted from modules themselves.\n");
-	fprintf(out, "# Copy, with a .conf extension, to /etc/modprobe.d to use "
-		"it with modprobe.\n");
-	for (i = modules; i; i = i->next) {
-		char modname[strlen(i->pathname)+1];
+	char tmpname[strlen(dirname) + 1 + strlen(d->name)
+		     + strlen(".temp") + 1];
+	int symbols = streq(d->name, "modules.symbols");
+	struct inc_module *m;
+	struct inc_text t;
+	unsigned int i;
+	FILE *out;
 
-		file = i->file;
-		filename2modname(modname, i->pathname);
+	if (!inc_read_text(dirname, d->name, &t))
+		return 0;
+	for (i = 0; i < st->count; i++)
+		st->mods[i].text_count = 0;
+	for (i = t.header; i < t.count; i++) {
+		m = inc_line_owner(st, d->name, t.lines[i]);
+		if (!m) {
+			info("%s has a line for an unknown module\n", d->name);
+			goto fail;
+		}
+		if (!m->text_count)
+			m->text_start = i;
+		else if (m->text_start + m->text_count != i && !symbols) {
+			info("%s lists %s in two places\n", d->name,
+			     m->modname);
+			goto fail;
+		}
+		m->text_count++;
+	}
 
-		/* Grab from new-style .modinfo section. */
-		tbl = file->ops->load_strings(file, ".modinfo", NULL);
-		for (j = 0; tbl && j < tbl->cnt; j++) {
-			const char *p = tbl->str[j];
-			if (strstarts(p, "softdep="))
-				fprintf(out, "softdep %s %s\n",
-					modname, p + strlen("softdep="));
+	sprintf(tmpname, "%s/%s.temp", dirname, d->name);
+	out = fopen(tmpname, "w");
+	if (!out)
+		fatal("Could not open %s for writing: %s\n",
+			tmpname, strerror(errno));
+	for (i = 0; i < t.header; i++)
+		fputs(t.lines[i], out);
+	if (symbols)
+		inc_write_symbols(st, &t, out);
+	for (i = 0; i < n && !symbols; i++) {
+		unsigned int j;
+
+		m = order[i];
+		if (m->changed) {
+			inc_module_text(d, m, out, dirname);
+			continue;
 		}
-		strtbl_free(tbl);
+		for (j = 0; j < m->text_count; j++)
+			fputs(t.lines[m->text_start + j], out);
 	}
+	fclose(out);
+	inc_free_text(&t);
 	return 1;
+
+fail:
+	inc_free_text(&t);
+	return 0;
 }
 
 /**
- * output_devname - output device names required by modules
+ * update_indexes - update the output files for some modules (depmod -i)
  *
- * @modules:	list of modules
- * @out:	output file reference
- * @dirname:	output directory
+ * @dirname:	top-level directory
+ * @list:	modules given on the command line
+ * @search:	path search order
+ * @overrides:	module override directives
  *
+ * Returns 0, having written nothing, if a full run is needed instead.
  */
-static int output_devname(struct module *modules, FILE *out, char *dirname)
+static int update_indexes(char *dirname, struct module *list,
+			  struct module_search *search,
+			  struct module_overrides *overrides)
 {
-	struct module *m;
+	struct inc_state st;
+	struct module *mod;
+	struct inc_module *m, **order = NULL;
+	const char **oldpaths = NULL;
+	unsigned int i, j, n, num_old = 0;
+	int ok = 0;
+
+	memset(&st, 0, sizeof(st));
+	st.dirname = dirname;
+	st.ambiguous = NOFAIL(calloc(sizeof(struct module) + 1, 1));
+	if (!(st.deps = inc_load(dirname, "modules.dep.bin"))
+	    || !(st.aliases = inc_load(dirname, "modules.alias.bin"))
+	    || !(st.symbols = inc_load(dirname, "modules.symbols.bin")))
+		goto out;
+
+	index_foreach(st.deps, inc_add_line, &st);
+	if (st.duplicates) {
+		info("Some modules have the same name\n");
+		goto out;
+	}
 
-	fprintf(out, "# Device nodes to trigger on-demand module loading.\n");
-	for (m = modules; m != NULL; m = m->next) {
-		struct string_table *tbl;
-		int i;
-		char type = '\0';
-		const char *devname = NULL;
-
-		tbl = m->file->ops->load_strings(m->file, ".modinfo", NULL);
-		for (i = 0; tbl && i < tbl->cnt; i++) {
-			const char *p = tbl->str[i];
-			unsigned int maj, min;
-
-			if (sscanf(p, "alias=char-major-%u-%u", &maj, &min) == 2)
-				type = 'c';
-			else if (sscanf(p, "alias=block-major-%u-%u", &maj, &min) == 2)
-				type = 'b';
-			else if (strstarts(p, "alias=devname:"))
-				devname = &p[strlen("alias=devname:")];
-
-			if (type && devname) {
-				char modname[strlen(m->pathname)+1];
-
-				filename2modname(modname, m->pathname);
-				fprintf(out, "%s %s %c%u:%u\n",
-					modname, devname, type, maj, min);
+	for (mod = list; mod; mod = mod->next)
+		if (!inc_add_module(&st, mod, search, overrides))
+			goto out;
+
+	for (i = 0; i < st.count; i++) {
+		m = &st.mods[i];
+		if (m->changed && (!inc_update_aliases(&st, m)
+				   || !inc_update_symbols(&st, m)))
+			goto out;
+	}
+
+	/* Modules which depended on the old versions need new lists */
+	oldpaths = NOFAIL(calloc(st.count, sizeof(char *)));
+	for (i = 0; i < st.count; i++)
+		if (st.mods[i].oldpath)
+			oldpaths[num_old++] = st.mods[i].oldpath;
+	for (i = 0; i < st.count; i++) {
+		m = &st.mods[i];
+		if (m->changed)
+			continue;
+		for (j = 0; j < num_old; j++) {
+			if (inc_line_has(m->line, oldpaths[j])) {
+				if (!inc_grab(&st, m))
+					goto out;
 				break;
 			}
 		}
-		strtbl_free(tbl);
 	}
-	return 1;
-}
 
-struct depfile {
-	const char *name;
-	int (*func)(struct module *, FILE *, char *dirname);
-	int map_file;
-};
+	index_foreach(st.symbols, inc_add_symbol, &st);
+	for (i = 0; i < st.count; i++) {
+		m = &st.mods[i];
+		if (!m->changed)
+			continue;
+		calculate_deps(m->mod);
+		for (j = 0; j < m->mod->num_deps; j++) {
+			if (m->mod->deps[j] == st.ambiguous) {
+				info("%s needs a symbol with two exporters\n",
+				     m->modname);
+				goto out;
+			}
+		}
+	}
 
-/* The possible output files - those with map_file unset typically not made */
-static const struct depfile depfiles[] = {
-	{ "modules.dep", output_deps, 0 }, /* This is what we check for '-A'. */
-	{ "modules.dep.bin", output_deps_bin, 0 },
-	{ "modules.pcimap", output_pci_table, 1 },
-	{ "modules.usbmap", output_usb_table, 1 },
-	{ "modules.ccwmap", output_ccw_table, 1 },
-	{ "modules.ieee1394map", output_ieee1394_table, 1 },
-	{ "modules.isapnpmap", output_isapnp_table, 1 },
-	{ "modules.inputmap", output_input_table, 1 },
-	{ "modules.ofmap", output_of_table, 1 },
-	{ "modules.seriomap", output_serio_table, 1 },
-	{ "modules.alias", output_aliases, 0 },
-	{ "modules.alias.bin", output_aliases_bin, 0 },
-	{ "modules.softdep", output_softdeps, 0 },
-	{ "modules.symbols", output_symbols, 0 },
-	{ "modules.symbols.bin", output_symbols_bin, 0 },
-	{ "modules.builtin.bin", output_builtin_bin, 0 },
-	{ "modules.devname", output_devname, 0 },
-};
+	for (i = 0; i < st.count; i++) {
+		char *line, *p;
 
-/**
- * any_modules_newer - determine if modules are newer than ref time
- *
- * @dirname:	directory to process
- * @mtime:	comparison time
+		m = &st.mods[i];
+		if (!m->changed)
+			continue;
+		if (!inc_deps(&st, m))
+			goto out;
+
+		nofail_asprintf(&line, "%s:", m->relpath);
+		for (j = 0; j < m->num_deps; j++) {
+			p = line;
+			nofail_asprintf(&line, "%s %s", p, m->deps[j]);
+			free(p);
+		}
+		if (m->line)
+			index_remove(st.deps, m->modname, m->line);
+		index_insert(st.deps, m->modname, line, m->order);
+		m->newline = line;
+	}
+
+	/* The text files must agree with the indexes */
+	order = NOFAIL(malloc(st.count * sizeof(*order)));
+	n = inc_text_order(&st, order);
+	if (!n)
+		goto out;
+	for (i = 0; i < ARRAY_SIZE(depfiles); i++) {
+		if (inc_text_file(&depfiles[i])
+		    && !inc_write_text(&st, &depfiles[i], order, n, dirname)) {
+			while (i-- > 0)
+				if (inc_text_file(&depfiles[i]))
+					inc_unlink(dirname, depfiles[i].name);
+			goto out;
+		}
+	}
+
+	inc_write(dirname, "modules.dep.bin", st.deps, 1);
+	inc_write(dirname, "modules.alias.bin", st.aliases, 0);
+	inc_write(dirname, "modules.symbols.bin", st.symbols, 0);
+	inc_rename(dirname, "modules.dep.bin");
+	inc_rename(dirname, "modules.alias.bin");
+	inc_rename(dirname, "modules.symbols.bin");
+	for (i = 0; i < ARRAY_SIZE(depfiles); i++)
+		if (inc_text_file(&depfiles[i]))
+			inc_rename(dirname, depfiles[i].name);
+	ok = 1;
+
+out:
+	forget_module_symbols();
+	for (i = 0; i < st.count; i++) {
+		m = &st.mods[i];
+		if (m->mod && !m->mod->loaded)
+			free(m->mod);
+		free(m->modname);
+		free(m->relpath);
+		free(m->oldpath);
+		free(m->deps);
+		free(m->copy);
+		free(m->newline);
+	}
+	free(order);
+	free(st.mods);
+	free(st.ambiguous);
+	free(oldpaths);
+	if (st.deps)
+		index_destroy(st.deps);
+	if (st.aliases)
+		index_destroy(st.aliases);
+	if (st.symbols)
+		index_destroy(st.symbols);
+	return ok;
+}
+
+/*
+ * Watch mode (depmod --watch)
  *
- * The worst case is that we process modules we didn't need to. It is
- * therefore safer to go with "true" if we can't figure it out.
+ * Rather than rerunning depmod each time modules are dropped into the
+ * tree, depmod can stay running and watch every directory it would scan
+ * with inotify.  Once modules have been added, changed or removed, and
+ * nothing more has happened for WATCH_SETTLE_MS, the files are rebuilt:
+ * a burst of changes (a whole package being unpacked, say) makes for
+ * one rebuild.
  *
+ * Each rebuild is a full run in a child process, so the watcher itself
+ * never holds (or leaks) any module state.  It is still cheap: only the
+ * modules which changed are read again, the rest come from
+ * modules.cache, and every file is replaced atomically as usual.
  */
-static int any_modules_newer(const char *dirname, time_t mtime)
+#define WATCH_SETTLE_MS 500
+
+struct watch
+{
+	int fd;
+	/* Watch of the module directory itself */
+	int top;
+	/* Watches seen during this walk, indexed by descriptor */
+	unsigned int max_seen;
+	char *seen;
+	int warned;
+};
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+		      | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF \
+		      | IN_ONLYDIR)
+
+/* Watch @path and the directories below it, as grab_dir would scan them */
+static int watch_dir(struct watch *w, const char *path)
 {
 	DIR *dir;
 	struct dirent *dirent;
+	int wd;
+
+	wd = inotify_add_watch(w->fd, path, WATCH_EVENTS);
+	if (wd < 0) {
+		if (!w->warned)
+			warn("Could not watch %s: %s\n", path, strerror(errno));
+		w->warned = 1;
+		return wd;
+	}
+	if (wd >= w->max_seen) {
+		unsigned int max = (wd + 1) * 2;
 
-	dir = opendir(dirname);
-	if (!dir)
-		return 1;
+		w->seen = NOFAIL(realloc(w->seen, max));
+		memset(w->seen + w->max_seen, 0, max - w->max_seen);
+		w->max_seen = max;
+	}
+	/* Already seen on this walk: a symlink back up the tree. */
+	if (w->seen[wd])
+		return wd;
+	w->seen[wd] = 1;
 
+	dir = opendir(path);
+	if (!dir)
+		return wd;
 	while ((dirent = readdir(dir)) != NULL) {
-		struct stat st;
-		char file[strlen(dirname) + 1 + strlen(dirent->d_name) + 1];
-
-		if (streq(dirent->d_name, ".") || streq(dirent->d_name, ".."))
+		char *subpath;
+
+		if (smells_like_module(dirent->d_name)
+		    || streq(dirent->d_name, ".")
+		    || streq(dirent->d_name, "..")
+		    || streq(dirent->d_name, "source")
+		    || streq(dirent->d_name, "build")
+		    || is_dir_entry(dirfd(dir), dirent, 1) <= 0)
 			continue;
 
-		sprintf(file, "%s/%s", dirname, dirent->d_name);
-		if (lstat(file, &st) != 0)
-			goto ret_true;
-
-		if (smells_like_module(dirent->d_name)) {
-			if (st.st_mtime > mtime)
-				goto ret_true;
-		} else if (S_ISDIR(st.st_mode)) {
-			if (any_modules_newer(file, mtime))
-				goto ret_true;
-		}
+		nofail_asprintf(&subpath, "%s/%s", path, dirent->d_name);
+		watch_dir(w, subpath);
+		free(subpath);
 	}
 	closedir(dir);
-	return 0;
+	return wd;
+}
 
-ret_true:
-	closedir(dir);
-	return 1;
+/* Watch the whole tree again, picking up any new directories */
+static void watch_tree(struct watch *w, const char *dirname)
+{
+	memset(w->seen, 0, w->max_seen);
+	w->top = watch_dir(w, dirname);
+	if (w->top < 0)
+		fatal("Could not watch %s\n", dirname);
 }
 
 /**
- * depfile_out_of_date - check if module dep files are older than any modules
+ * read_watch_events - read what inotify has for us
  *
- * @dirname:	directory to process
+ * @w:		the watches
+ * @dirname:	module directory
  *
- * Use any_modules_newer to determine if the dep files are up to date.
+ * Returns 1 if any of the events could matter to the output files: a
+ * module or directory coming, going or being written, or events lost.
  *
  */
-static int depfile_out_of_date(const char *dirname)
+static int read_watch_events(struct watch *w, const char *dirname)
 {
-	struct stat st;
-	char depfile[strlen(dirname) + 1 + strlen(depfiles[0].name) + 1];
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int relevant = 0;
 
-	sprintf(depfile, "%s/%s", dirname, depfiles[0].name);
+	len = read(w->fd, buf, sizeof(buf));
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		fatal("Could not read inotify events: %s\n", strerror(errno));
+	}
 
-	if (stat(depfile, &st) != 0)
-		return 1;
+	for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)p;
+
+		if (ev->wd == w->top
+		    && (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)))
+			fatal("%s has gone away\n", dirname);
+		if ((ev->mask & (IN_Q_OVERFLOW | IN_ISDIR
+				 | IN_DELETE_SELF | IN_MOVE_SELF))
+		    || (ev->len && smells_like_module(ev->name)))
+			relevant = 1;
+	}
+	return relevant;
+}
+
+/* Wait for @ms (or for ever, if negative) for inotify to have events */
+static int wait_watch(struct watch *w, int ms)
+{
+	struct pollfd pfd = { w->fd, POLLIN, 0 };
+	int ret;
+
+	ret = poll(&pfd, 1, ms);
+	if (ret < 0 && errno != EINTR)
+		fatal("Could not poll for inotify events: %s\n",
+		      strerror(errno));
+	return ret > 0;
+}
+
+/* Rebuild every file in a child process, and wait for it */
+static void watch_rebuild(char *dirname,
+			  struct module_search *search,
+			  struct module_overrides *overrides)
+{
+	struct stats_timer total;
+	struct module *list;
+	pid_t pid;
+	int status;
+
+	info("Rebuilding %s\n", dirname);
+	pid = fork();
+	if (pid < 0) {
+		warn("Could not fork to rebuild %s: %s\n",
+		     dirname, strerror(errno));
+		return;
+	}
+	if (pid == 0) {
+		stats_start(&total, 0);
+		list = grab_basedir(dirname, search, overrides);
+		list = sort_modules(dirname, list);
+		list = parse_modules(list);
+		write_cache(list);
+		write_depfiles(list, dirname);
+		write_stamp(dirname);
+		stats_stop(&total, STATS_TOTAL, 0);
+		print_stats(list);
+		exit(0);
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			fatal("Could not wait for rebuild: %s\n",
+			      strerror(errno));
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		warn("Rebuilding %s failed, still watching\n", dirname);
+}
 
-	return any_modules_newer(dirname, st.st_mtime);
+/**
+ * watch_modules - keep the files up to date as modules come and go
+ *
+ * @dirname:	module directory
+ * @search:	search order
+ * @overrides:	module overrides
+ * @build:	whether to rebuild before anything changes
+ *
+ * Never returns.
+ *
+ */
+static void watch_modules(char *dirname,
+			  struct module_search *search,
+			  struct module_overrides *overrides,
+			  int build)
+{
+	struct watch w = { -1, -1, 0, NULL, 0 };
+
+	w.fd = inotify_init();
+	if (w.fd < 0)
+		fatal("Could not start watching %s: %s\n",
+		      dirname, strerror(errno));
+
+	/* Watch first, so nothing is missed while we build. */
+	watch_tree(&w, dirname);
+	if (build)
+		watch_rebuild(dirname, search, overrides);
+
+	for (;;) {
+		while (!(wait_watch(&w, -1) && read_watch_events(&w, dirname)))
+			;
+		/* Let the burst settle before doing anything. */
+		while (wait_watch(&w, WATCH_SETTLE_MS))
+			read_watch_events(&w, dirname);
+
+		watch_tree(&w, dirname);
+		watch_rebuild(dirname, search, overrides);
+	}
 }
 
 /**
@@ -1733,16 +4833,18 @@ static struct module_overrides *overrides = NULL;
 
 int main(int argc, char *argv[])
 {
-	int opt, all = 0, maybe_all = 0, doing_stdout = 0;
+	int opt, all = 0, maybe_all = 0, doing_stdout = 0, incremental = 0;
+	int watch = 0, up_to_date = 0;
 	char *basedir = "", *dirname, *version;
 	char *system_map = NULL, *module_symvers = NULL;
 	int i;
 	const char *config = NULL;
+	struct stats_timer total;
 
 	if (native_endianness() == 0)
 		abort();
 
-	while ((opt = getopt_long(argc, argv, "aAb:C:E:F:euqrvnP:hVwm", options, NULL))
+	while ((opt = getopt_long(argc, argv, "aAb:C:E:F:euqrvnP:hVwmij:RWS", options, NULL))
 	       != -1) {
 		switch (opt) {
 		case 'a':
@@ -1796,11 +4898,28 @@ int main(int argc, char *argv[])
 		case 'm':
 			force_map_files = 1;
 			break;
+		case 'i':
+			incremental = 1;
+			break;
+		case 'j':
+			if (sscanf(optarg, "%u", &jobs) != 1 || jobs == 0)
+				fatal("-j needs a number of threads\n");
+			break;
+		case 'R':
+			rebuild_cache = 1;
+			break;
+		case 'W':
+			watch = 1;
+			break;
+		case 'S':
+			show_stats = 1;
+			break;
 		default:
 			print_usage(argv[0]);
 			exit(1);
 		}
 	}
+	stats_start(&total, 0);
 
 	if (module_symvers)
 		load_module_symvers(module_symvers);
@@ -1834,9 +4953,16 @@ int main(int argc, char *argv[])
 
 	nofail_asprintf(&dirname, "%s%s%s", basedir, MODULE_DIR, version);
 
+	if (watch && (!all || doing_stdout))
+		fatal("--watch works on the whole module directory, "
+		      "and needs to write the files\n");
+
 	if (maybe_all) {
-		if (!doing_stdout && !depfile_out_of_date(dirname))
-			exit(0);
+		if (!doing_stdout && !depfile_out_of_date(dirname)) {
+			if (!watch)
+				exit(0);
+			up_to_date = 1;
+		}
 		all = 1;
 	}
 
@@ -1854,6 +4980,9 @@ int main(int argc, char *argv[])
 		len = strlen(dirname);
 		search = add_search(dirname, len, search);
 	}
+	if (watch)
+		watch_modules(dirname, search, overrides, !up_to_date);
+
 	if (!all) {
 		/* Do command line args. */
 		for (opt = optind; opt < argc; opt++) {
@@ -1871,50 +5000,44 @@ int main(int argc, char *argv[])
 			new->next = list;
 			list = new;
 		}
+
+		if (incremental && !doing_stdout) {
+			if (update_indexes(dirname, list, search, overrides))
+				goto done;
+			info("Rebuilding all indexes\n");
+			while (list) {
+				struct module *next = list->next;
+
+				free_module(list);
+				list = next;
+			}
+			list = grab_basedir(dirname, search, overrides);
+			all = 1;
+		}
 	} else {
 		list = grab_basedir(dirname,search,overrides);
 	}
 	list = sort_modules(dirname,list);
 	list = parse_modules(list);
+	if (!doing_stdout)
+		write_cache(list);
 
-	for (i = 0; i < ARRAY_SIZE(depfiles); i++) {
-		FILE *out;
-		int res;
-		const struct depfile *d = &depfiles[i];
-		char depname[strlen(dirname) + 1 + strlen(d->name) + 1];
-		char tmpname[strlen(dirname) + 1 + strlen(d->name) +
-						strlen(".temp") + 1];
-
-		if (d->map_file && !make_map_files && !force_map_files)
-			continue;
+	if (doing_stdout) {
+		for (i = 0; i < ARRAY_SIZE(depfiles); i++) {
+			const struct depfile *d = &depfiles[i];
 
-		sprintf(depname, "%s/%s", dirname, d->name);
-		sprintf(tmpname, "%s/%s.temp", dirname, d->name);
-		if (!doing_stdout) {
-			out = fopen(tmpname, "w");
-			if (!out)
-				fatal("Could not open %s for writing: %s\n",
-					tmpname, strerror(errno));
-		} else {
-			out = stdout;
-			if (ends_in(depname, ".bin"))
-				continue;
-		}
-		res = d->func(list, out, dirname);
-		if (doing_stdout)
-			continue;
-		fclose(out);
-		if (res) {
-			if (rename(tmpname, depname) < 0)
-				fatal("Could not rename %s into %s: %s\n",
-					tmpname, depname, strerror(errno));
-		} else {
-			if (unlink(tmpname) < 0)
-				warn("Could not delete %s: %s\n",
-					tmpname, strerror(errno));
+			if (wanted_depfile(d) && !ends_in(d->name, ".bin"))
+				output_depfile(d, list, stdout, dirname);
 		}
+	} else {
+		write_depfiles(list, dirname);
+		if (all)
+			write_stamp(dirname);
 	}
 
+done:
+	stats_stop(&total, STATS_TOTAL, 0);
+	print_stats(list);
 	free(dirname);
 	free(version);
 	
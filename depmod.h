@@ -9,6 +9,17 @@
 
 struct module;
 
+/* What the output functions want from .modalias and .modinfo */
+struct module_info
+{
+	char *modname;
+	struct string_table *aliases;	/* .modalias, then alias= */
+	struct string_table *softdeps;
+	const char *devname;		/* only if given a device number */
+	char devtype;			/* 'c' or 'b' */
+	unsigned int major, minor;
+};
+
 /* This is not the same as the module struct in the kernel built .ko files */
 struct module
 {
@@ -19,8 +30,18 @@ struct module
 	unsigned int num_deps;
 	struct module **deps;
 
-	/* Set while we are traversing dependencies */
-	struct list_head dep_list;
+	/* Number in the list once loops are gone, and every dependency
+	   (recursively) in the order order_dep_list() puts them */
+	unsigned int id;
+	unsigned int num_all_deps;
+	struct module **all_deps;
+
+	/* Used by find_loops() */
+	unsigned int loop_index, loop_low;
+	struct module *loop_stack, *loop_scc, *loop_parent;
+	int on_loop_stack;
+	int in_loop;		/* needs a module in a dependency loop */
+	int report_loop;	/* report the loop through this module */
 
 	/* Line number in modules.order (or INDEX_PRIORITY_MIN) */
 	unsigned int order;
@@ -28,7 +49,31 @@ struct module
 	/* Tables extracted from module by ops->fetch_tables(). */
 	struct module_tables tables;
 
-	/* Module operations, endian conversion required, etc. */
+	/* Symbols exported, and needed, as found by read_module() or
+	   taken from the cache. */
+	struct string_table *exports;
+	uint64_t *export_vers;
+	struct string_table *dep_syms;
+	struct string_table *dep_types;
+	uint64_t *dep_vers;
+
+	/* Old-style .modalias and new-style .modinfo strings. */
+	struct string_table *modalias;
+	struct string_table *modinfo;
+	int cacheable;		/* worth saving in the cache */
+	uint64_t ino, size;	/* the file as it was read, or checked */
+	int64_t mtime;		/* against the cache: what the cache */
+	uint32_t mtime_nsec;	/* records for it */
+	int loaded;		/* by read_module(), or from the cache */
+	int load_error;		/* errno, if the file couldn't be read */
+	void *data;		/* what the above point to, once the
+				   file has gone (see copy_module_data()) */
+
+	/* Filled in from the above by parse_modinfo(). */
+	struct module_info info;
+
+	/* Module operations, endian conversion required, etc.  Only
+	   while the module is being read (and not from the cache). */
 	struct elf_file *file;
 
 	char *basename; /* points into pathname */
@@ -28,6 +28,36 @@ static const char *skip_dot(const char *str)
        return str;
 }
 
+/* Sections sorted by name, and in the file's order within a name */
+static int section_cmp(const void *a, const void *b)
+{
+	const struct elf_section *x = a, *y = b;
+	int ret = strcmp(x->name, y->name);
+
+	if (ret)
+		return ret;
+	return x->hdr < y->hdr ? -1 : x->hdr > y->hdr;
+}
+
+/* The first section called @secname, or NULL */
+static const struct elf_section *find_section(struct elf_file *module,
+					      const char *secname)
+{
+	unsigned int lo = 0, hi = module->num_sections, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(module->sections[mid].name, secname) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == module->num_sections
+	    || !streq(module->sections[lo].name, secname))
+		return NULL;
+	return &module->sections[lo];
+}
+
 #define ELF32BIT
 #include "elfops_core.c"
 #undef ELF32BIT
@@ -63,6 +93,7 @@ static int elf_ident(void *file, unsigned long fsize, int *conv)
 struct elf_file *grab_elf_file(const char *pathname)
 {
 	struct elf_file *file;
+	int err;
 
 	file = malloc(sizeof(*file));
 	if (!file) {
@@ -77,22 +108,32 @@ struct elf_file *grab_elf_file(const char *pathname)
 	file->data = grab_file(pathname, &file->len);
 	if (!file->data)
 		goto fail_free_pathname;
+	file->sections = NULL;
+	file->num_sections = 0;
 
 	switch (elf_ident(file->data, file->len, &file->conv)) {
 	case ELFCLASS32:
 		file->ops = &mod_ops32;
+		err = index_sections32(file);
 		break;
 	case ELFCLASS64:
 		file->ops = &mod_ops64;
+		err = index_sections64(file);
 		break;
 	case -ENOEXEC: /* Not an ELF object */
 	case -EINVAL: /* Unknown endianness */
 	default: /* Unknown word size */
 		errno = ENOEXEC;
-		goto fail;
+		goto fail_release_data;
+	}
+	if (err < 0) {
+		errno = ENOMEM;
+		goto fail_release_data;
 	}
 	return file;
 
+fail_release_data:
+	release_file(file->data, file->len);
 fail_free_pathname:
 	free(file->pathname);
 fail_free_file:
@@ -109,6 +150,7 @@ void release_elf_file(struct elf_file *file)
 		return;
 
 	release_file(file->data, file->len);
+	free(file->sections);
 	free(file->pathname);
 	free(file);
 
@@ -18,6 +18,19 @@ struct modver_info64
 	char name[64 - sizeof(uint64_t)];
 };
 
+/* A section of an elf_file, as found by name */
+struct elf_section
+{
+	const char *name;
+
+	/* Contents (NULL if not within the file), and size */
+	void *data;
+	unsigned long size;
+
+	/* Section header: Elf32_Shdr or Elf64_Shdr */
+	void *hdr;
+};
+
 struct elf_file
 {
 	char *pathname;
@@ -31,30 +44,45 @@ struct elf_file
 	/* File contents and length. */
 	void *data;
 	unsigned long len;
+
+	/* Sections, sorted by name: see get_section() */
+	struct elf_section *sections;
+	unsigned int num_sections;
 };
 
 /* Tables extracted from module by ops->fetch_tables(). */
 struct module_tables
 {
+	int conv;		/* as the module's elf_file */
+
+	/* Size of an entry, and of the whole table as the module gives it */
 	unsigned int pci_size;
+	unsigned int pci_table_size;
 	void *pci_table;
 	unsigned int usb_size;
+	unsigned int usb_table_size;
 	void *usb_table;
 	unsigned int ieee1394_size;
+	unsigned int ieee1394_table_size;
 	void *ieee1394_table;
 	unsigned int ccw_size;
+	unsigned int ccw_table_size;
 	void *ccw_table;
 	unsigned int pnp_size;
+	unsigned int pnp_table_size;
 	void *pnp_table;
 	unsigned int pnp_card_size;
+	unsigned int pnp_card_table_size;
 	unsigned int pnp_card_offset;
 	void *pnp_card_table;
 	unsigned int input_size;
 	void *input_table;
 	unsigned int input_table_size;
 	unsigned int serio_size;
+	unsigned int serio_table_size;
 	void *serio_table;
 	unsigned int of_size;
+	unsigned int of_table_size;
 	void *of_table;
 };
 
@@ -18,10 +18,12 @@
 #  error "Undefined ELF word length"
 #endif
 
-static void *PERBIT(get_section)(struct elf_file *module,
-				 const char *secname,
-				 ElfPERBIT(Shdr) **sechdr,
-				 unsigned long *secsize)
+/*
+ * Index the sections by name for get_section(), once, when grab_elf_file()
+ * reads the file.  A file whose section headers aren't within it gets
+ * no sections.  Returns -1 if out of memory.
+ */
+static int PERBIT(index_sections)(struct elf_file *module)
 {
 	void *data = module->data;
 	unsigned long len = module->len;
@@ -31,15 +33,12 @@ static void *PERBIT(get_section)(struct elf_file *module,
 	ElfPERBIT(Shdr) *sechdrs;
 	ElfPERBIT(Off) e_shoff;
 	ElfPERBIT(Half) e_shnum, e_shstrndx;
-	ElfPERBIT(Off) secoffset;
 
 	const char *secnames;
 	unsigned int i;
 
-	*secsize = 0;
-
 	if (len <= 0 || len < sizeof(*hdr))
-		return NULL;
+		return 0;
 
 	hdr = data;
 	e_shoff = END(hdr->e_shoff, conv);
@@ -47,27 +46,55 @@ static void *PERBIT(get_section)(struct elf_file *module,
 	e_shstrndx = END(hdr->e_shstrndx, conv);
 
 	if (len < e_shoff + e_shnum * sizeof(sechdrs[0]))
-		return NULL;
+		return 0;
 
 	sechdrs = data + e_shoff;
 
-	if (len < END(sechdrs[e_shstrndx].sh_offset, conv))
-		return NULL;
+	if (e_shstrndx >= e_shnum
+	    || len < END(sechdrs[e_shstrndx].sh_offset, conv))
+		return 0;
 
-	/* Find section by name; return header, pointer and size. */
 	secnames = data + END(sechdrs[e_shstrndx].sh_offset, conv);
+	if (e_shnum > 1) {
+		module->sections = malloc((e_shnum - 1)
+					  * sizeof(module->sections[0]));
+		if (!module->sections)
+			return -1;
+	}
 	for (i = 1; i < e_shnum; i++) {
-		if (streq(secnames + END(sechdrs[i].sh_name, conv), secname)) {
-			*secsize = END(sechdrs[i].sh_size, conv);
-			secoffset = END(sechdrs[i].sh_offset, conv);
-			if (sechdr)
-				*sechdr = sechdrs + i;
-			if (len < secoffset + *secsize)
-				return NULL;
-			return data + secoffset;
-		}
+		struct elf_section *sec;
+		ElfPERBIT(Off) secoffset;
+
+		sec = &module->sections[module->num_sections++];
+		sec->name = secnames + END(sechdrs[i].sh_name, conv);
+		sec->size = END(sechdrs[i].sh_size, conv);
+		sec->hdr = sechdrs + i;
+		secoffset = END(sechdrs[i].sh_offset, conv);
+		if (len < secoffset + sec->size)
+			sec->data = NULL;
+		else
+			sec->data = data + secoffset;
 	}
-	return NULL;
+	qsort(module->sections, module->num_sections,
+	      sizeof(module->sections[0]), section_cmp);
+	return 0;
+}
+
+/* Find section by name; return header, pointer and size. */
+static void *PERBIT(get_section)(struct elf_file *module,
+				 const char *secname,
+				 ElfPERBIT(Shdr) **sechdr,
+				 unsigned long *secsize)
+{
+	const struct elf_section *sec = find_section(module, secname);
+
+	*secsize = 0;
+	if (!sec)
+		return NULL;
+	*secsize = sec->size;
+	if (sechdr)
+		*sechdr = sec->hdr;
+	return sec->data;
 }
 
 /* Load the given section: NULL on error. */
@@ -168,16 +195,35 @@ static char *PERBIT(get_modinfo)(struct elf_file *module, unsigned long *size)
 #define STT_REGISTER    13              /* Global register reserved to app. */
 #endif
 
+/*
+ * Find the slot of @name in the hash of __versions entries: each slot
+ * holds the index + 1 of the first entry of that name (see next[] for
+ * any more), or 0 if there's none.
+ */
+static unsigned int PERBIT(modver_slot)(struct PERBIT(modver_info) *symvers,
+					const unsigned int *hash,
+					unsigned int hash_size,
+					const char *name)
+{
+	unsigned int h = fnv_hash(name, 0) & (hash_size - 1);
+
+	while (hash[h] && !streq(symvers[hash[h] - 1].name, name))
+		h = (h + 1) & (hash_size - 1);
+	return h;
+}
+
 static struct string_table *PERBIT(load_dep_syms)(struct elf_file *module,
 						  struct string_table **types,
 						  uint64_t **versions)
 {
 	unsigned int i, num_syms;
 	unsigned int j, num_symvers, versions_size;
+	unsigned int *hash, *next, hash_size;
 	unsigned long size;
 	char *strings;
 	ElfPERBIT(Sym) *syms;
 	ElfPERBIT(Ehdr) *hdr;
+	struct PERBIT(modver_info) *symvers_sec;
 	struct PERBIT(modver_info) **symvers;
 	int handle_register_symbols;
 	struct string_table *names;
@@ -186,12 +232,13 @@ static struct string_table *PERBIT(load_dep_syms)(struct elf_file *module,
 	names = NULL;
 	*types = NULL;
 	symvers = NULL;
-	num_symvers = versions_size = 0;
+	symvers_sec = NULL;
+	hash = next = NULL;
+	num_symvers = versions_size = hash_size = 0;
 
 	if (versions) {
 		int ok = 1;
 		*versions = NULL;
-		struct PERBIT(modver_info) *symvers_sec;
 
 		symvers_sec = module->ops->load_section(module, "__versions",
 				&size);
@@ -215,6 +262,23 @@ static struct string_table *PERBIT(load_dep_syms)(struct elf_file *module,
 						sizeof(symvers[0])));
 			for (j = 0; j < num_symvers; j++)
 				symvers[j] = &symvers_sec[j];
+
+			/* Hash them by name, never more than half full.
+			 * Added last first, so that each name's chain
+			 * starts at its first entry. */
+			for (hash_size = 1; hash_size < num_symvers * 2; )
+				hash_size *= 2;
+			hash = NOFAIL(calloc(hash_size, sizeof(hash[0])));
+			next = NOFAIL(malloc((num_symvers ?: 1)
+					     * sizeof(next[0])));
+			for (j = num_symvers; j-- > 0; ) {
+				unsigned int h = PERBIT(modver_slot)(
+					symvers_sec, hash, hash_size,
+					symvers_sec[j].name);
+
+				next[j] = hash[h];
+				hash[h] = j + 1;
+			}
 		} else {
 			versions = NULL;
 		}
@@ -265,21 +329,15 @@ static struct string_table *PERBIT(load_dep_syms)(struct elf_file *module,
 
 			if (!versions)
 				continue;
-			/* Not optimal, but the number of required symbols
-			 * is usually not huge and this is only called by
-			 * depmod.
-			 */
-			for (j = 0; j < num_symvers; j++) {
-				struct PERBIT(modver_info) *info = symvers[j];
-
-				if (!info)
-					continue;
-				if (streq(name, info->name)) {
-					(*versions)[names->cnt - 1] =
-						END(info->crc, conv);
-					symvers[j] = NULL;
-					break;
-				}
+			/* The first entry of that name not yet taken */
+			j = hash[PERBIT(modver_slot)(symvers_sec, hash,
+						     hash_size, name)];
+			while (j && !symvers[j - 1])
+				j = next[j - 1];
+			if (j) {
+				(*versions)[names->cnt - 1] =
+					END(symvers[j - 1]->crc, conv);
+				symvers[j - 1] = NULL;
 			}
 		}
 	}
@@ -291,13 +349,16 @@ static struct string_table *PERBIT(load_dep_syms)(struct elf_file *module,
 			continue;
 		if ((names ? names->cnt : 0) >= versions_size) {
 			versions_size++;
-			*versions = NOFAIL(realloc(*versions, versions_size));
+			*versions = NOFAIL(realloc(*versions, versions_size
+						   * sizeof(**versions)));
 		}
 		names = NOFAIL(strtbl_add(info->name, names));
 		*types = NOFAIL(strtbl_add(undef_sym, *types));
 		(*versions)[names->cnt - 1] = END(info->crc, conv);
 	}
 out:
+	free(next);
+	free(hash);
 	free(symvers);
 	return names;
 }
@@ -344,6 +405,7 @@ static void PERBIT(fetch_tables)(struct elf_file *module,
 		return;
 
 	memset(tables, 0x00, sizeof(struct module_tables));
+	tables->conv = conv;
 
 	for (i = 0; i < size / sizeof(syms[0]); i++) {
 		char *name = strings + END(syms[i].st_name, conv);
@@ -351,32 +413,32 @@ static void PERBIT(fetch_tables)(struct elf_file *module,
 		if (!tables->pci_table && streq(name, "__mod_pci_device_table")) {
 			tables->pci_size = PERBIT(PCI_DEVICE_SIZE);
 			tables->pci_table = PERBIT(deref_sym)(hdr, sechdrs, &syms[i],
-							      NULL, conv);
+							      &tables->pci_table_size, conv);
 		}
 		else if (!tables->usb_table && streq(name, "__mod_usb_device_table")) {
 			tables->usb_size = PERBIT(USB_DEVICE_SIZE);
 			tables->usb_table = PERBIT(deref_sym)(hdr, sechdrs, &syms[i],
-							      NULL, conv);
+							      &tables->usb_table_size, conv);
 		}
 		else if (!tables->ccw_table && streq(name, "__mod_ccw_device_table")) {
 			tables->ccw_size = PERBIT(CCW_DEVICE_SIZE);
 			tables->ccw_table = PERBIT(deref_sym)(hdr, sechdrs, &syms[i],
-							      NULL, conv);
+							      &tables->ccw_table_size, conv);
 		}
 		else if (!tables->ieee1394_table && streq(name, "__mod_ieee1394_device_table")) {
 			tables->ieee1394_size = PERBIT(IEEE1394_DEVICE_SIZE);
 			tables->ieee1394_table = PERBIT(deref_sym)(hdr, sechdrs, &syms[i],
-								   NULL, conv);
+								   &tables->ieee1394_table_size, conv);
 		}
 		else if (!tables->pnp_table && streq(name, "__mod_pnp_device_table")) {
 			tables->pnp_size = PERBIT(PNP_DEVICE_SIZE);
 			tables->pnp_table = PERBIT(deref_sym)(hdr, sechdrs, &syms[i],
-							      NULL, conv);
+							      &tables->pnp_table_size, conv);
 		}
 		else if (!tables->pnp_card_table && streq(name, "__mod_pnp_card_device_table")) {
 			tables->pnp_card_size = PERBIT(PNP_CARD_DEVICE_SIZE);
 			tables->pnp_card_table = PERBIT(deref_sym)(hdr, sechdrs, &syms[i],
-								   NULL, conv);
+								   &tables->pnp_card_table_size, conv);
 			tables->pnp_card_offset = PERBIT(PNP_CARD_DEVICE_OFFSET);
 		}
 		else if (!tables->input_table && streq(name, "__mod_input_device_table")) {
@@ -388,12 +450,12 @@ static void PERBIT(fetch_tables)(struct elf_file *module,
 		else if (!tables->serio_table && streq(name, "__mod_serio_device_table")) {
 			tables->serio_size = PERBIT(SERIO_DEVICE_SIZE);
 			tables->serio_table = PERBIT(deref_sym)(hdr, sechdrs, &syms[i],
-								NULL, conv);
+								&tables->serio_table_size, conv);
 		}
 		else if (!tables->of_table && streq(name, "__mod_of_device_table")) {
 			tables->of_size = PERBIT(OF_DEVICE_SIZE);
 			tables->of_table = PERBIT(deref_sym)(hdr, sechdrs, &syms[i],
-							     NULL, conv);
+							     &tables->of_table_size, conv);
 		}
 	}
 }
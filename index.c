@@ -21,28 +21,127 @@
 #include <string.h>
 #include <errno.h>
 #include <fnmatch.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "util.h"
 #include "logging.h"
 #include "index.h"
+#include "list.h"
 
 #include "testing.h"
 
 /*
  * Index abstract data type (used only by depmod)
+ *
+ * Nodes, child tables, prefixes and values all come from an arena owned
+ * by the root node, so building an index does a handful of large
+ * allocations and destroying it frees them in one go.
+ *
+ * Value strings are interned: each distinct string is stored once, and
+ * values are compared by pointer.  The same module name is the value of
+ * thousands of aliases or symbols.
  */
 
-struct index_node *index_create()
+#define INDEX_ARENA_CHUNK (64 * 1024)
+
+struct index_chunk {
+	struct index_chunk *next;
+	size_t size;
+	size_t used;
+	char data[0];
+};
+
+/* Child tables are allocated in power-of-two sizes from 1 to
+   INDEX_CHILDMAX, and recycled when a table outgrows its allocation. */
+#define INDEX_CHILD_CLASSES 8
+
+struct index_arena {
+	struct index_chunk *chunks;
+	void *free_children[INDEX_CHILD_CLASSES];
+};
+
+/* An interned value string */
+struct index_string {
+	unsigned int id;	/* in order of interning */
+	char str[0];
+};
+
+/* Open-addressed hash table of interned strings */
+struct index_strings {
+	unsigned int count;
+	unsigned int size;	/* power of two */
+	struct index_string **slots;
+};
+
+/* The root node carries the arena and the strings for the whole tree */
+struct index_root {
+	struct index_node node;
+	struct index_arena arena;
+	struct index_strings strings;
+};
+
+static struct index_root *index__root(const struct index_node *root)
+{
+	return container_of(root, struct index_root, node);
+}
+
+static void *index__alloc(struct index_arena *arena, size_t size, size_t align)
+{
+	struct index_chunk *chunk = arena->chunks;
+	size_t used = 0;
+
+	if (chunk)
+		used = (chunk->used + align - 1) & ~(align - 1);
+
+	if (!chunk || used + size > chunk->size) {
+		size_t chunk_size = INDEX_ARENA_CHUNK;
+
+		if (size > chunk_size / 4)
+			chunk_size = size;
+		chunk = NOFAIL(malloc(sizeof(struct index_chunk) + chunk_size));
+		chunk->size = chunk_size;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		used = 0;
+	}
+
+	chunk->used = used + size;
+	return chunk->data + used;
+}
+
+static char *index__strdup(struct index_arena *arena, const char *str)
+{
+	size_t len = strlen(str) + 1;
+
+	return memcpy(index__alloc(arena, len, 1), str, len);
+}
+
+static struct index_node *index__newnode(struct index_arena *arena,
+					 char *prefix)
 {
 	struct index_node *node;
 
-	node = NOFAIL(calloc(sizeof(struct index_node), 1));
-	node->prefix = NOFAIL(strdup(""));
-	node->first = INDEX_CHILDMAX;
-	
+	node = index__alloc(arena, sizeof(struct index_node),
+			    __alignof__(struct index_node));
+	memset(node, 0, sizeof(struct index_node));
+	node->prefix = prefix;
 	return node;
 }
 
+struct index_node *index_create()
+{
+	struct index_root *root;
+
+	root = NOFAIL(calloc(sizeof(struct index_root), 1));
+	root->node.prefix = index__strdup(&root->arena, "");
+	
+	return &root->node;
+}
+
 void index_values_free(struct index_value *values)
 {
 	while (values) {
@@ -55,17 +154,15 @@ void index_values_free(struct index_value *values)
 
 void index_destroy(struct index_node *node)
 {
-	int c;
-	
-	for (c = node->first; c <= node->last; c++) {
-		struct index_node *child = node->children[c];
-		
-		if (child)
-			index_destroy(child);
+	struct index_arena *arena = &index__root(node)->arena;
+	struct index_chunk *chunk;
+
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		free(chunk);
 	}
-	index_values_free(node->values);
-	free(node->prefix);
-	free(node);
+	free(index__root(node)->strings.slots);
+	free(index__root(node));
 }
 
 static void index__checkstring(const char *str)
@@ -81,43 +178,211 @@ static void index__checkstring(const char *str)
 	}
 }
 
-static int add_value(struct index_value **values,
-		     const char *value, unsigned int priority)
+/* Hash function from gdbm, via tdb (as used by depmod) */
+static unsigned int index__hash(const char *str, size_t len)
+{
+	unsigned int value = 0x238F13AF * len;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		value = value + (((unsigned char *)str)[i] << (i*5 % 24));
+
+	return 1103515243 * value + 12345;
+}
+
+static void index__strings_grow(struct index_strings *strings)
+{
+	unsigned int size = strings->size ? strings->size * 2 : 256;
+	struct index_string **slots;
+	unsigned int i;
+
+	slots = NOFAIL(calloc(size, sizeof(*slots)));
+	for (i = 0; i < strings->size; i++) {
+		struct index_string *s = strings->slots[i];
+		unsigned int h;
+
+		if (!s)
+			continue;
+		h = index__hash(s->str, strlen(s->str)) & (size - 1);
+		while (slots[h])
+			h = (h + 1) & (size - 1);
+		slots[h] = s;
+	}
+	free(strings->slots);
+	strings->slots = slots;
+	strings->size = size;
+}
+
+/* Return the interned copy of str */
+static const char *index__intern(struct index_root *root, const char *str)
+{
+	struct index_strings *strings = &root->strings;
+	struct index_string *s;
+	size_t len = strlen(str);
+	unsigned int h;
+
+	/* Keep the table at most half full */
+	if (2 * (strings->count + 1) > strings->size)
+		index__strings_grow(strings);
+
+	h = index__hash(str, len) & (strings->size - 1);
+	while ((s = strings->slots[h])) {
+		if (streq(s->str, str))
+			return s->str;
+		h = (h + 1) & (strings->size - 1);
+	}
+
+	s = index__alloc(&root->arena, sizeof(struct index_string) + len + 1,
+			 __alignof__(struct index_string));
+	s->id = strings->count++;
+	memcpy(s->str, str, len + 1);
+	strings->slots[h] = s;
+	return s->str;
+}
+
+static unsigned int index__string_id(const char *str)
+{
+	return container_of(str, struct index_string, str[0])->id;
+}
+
+/* Allocate a value from the arena for an interned string, or from the heap
+   with its own copy of the string if arena is NULL */
+static struct index_value *index__newvalue(struct index_arena *arena,
+					   const char *value,
+					   unsigned int priority)
+{
+	struct index_value *v;
+
+	if (arena) {
+		v = index__alloc(arena, sizeof(struct index_value),
+				 __alignof__(struct index_value));
+		v->value = value;
+	} else {
+		size_t len = strlen(value);
+
+		v = NOFAIL(malloc(sizeof(struct index_value) + len + 1));
+		v->value = memcpy((char *)(v + 1), value, len + 1);
+	}
+	v->next = NULL;
+	v->priority = priority;
+	return v;
+}
+
+/* Values are compared by pointer, which is enough for interned strings */
+static int add_value(struct index_value **values, struct index_value *new)
 {
 	struct index_value *v;
 	int duplicate = 0;
-	int len;
 
 	/* report the presence of duplicate values */
 	for (v = *values; v; v = v->next) {
-		if (streq(v->value, value))
+		if (v->value == new->value)
 			duplicate = 1;
 	}
 
 	/* find position to insert value */
-	while (*values && (*values)->priority < priority)
+	while (*values && (*values)->priority < new->priority)
 		values = &(*values)->next;
 
-	len = strlen(value);
-	v = NOFAIL(calloc(sizeof(struct index_value) + len + 1, 1));
-	v->next = *values;
-	v->priority = priority;
-	memcpy(v->value, value, len + 1);
-	*values = v;
+	new->next = *values;
+	*values = new;
 
 	return duplicate;
 }
 
+/* Find the slot for ch in the sorted child table */
+static int index__childpos(const struct index_node *node, int ch)
+{
+	int lo = 0, hi = node->child_count;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (node->child_chars[mid] < ch)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct index_node *index__getchild(const struct index_node *node,
+					  int ch)
+{
+	int pos = index__childpos(node, ch);
+
+	if (pos < node->child_count && node->child_chars[pos] == ch)
+		return node->children[pos];
+	return NULL;
+}
+
+/* A child table of class c holds 1 << c pointers, then as many chars */
+static void index__growchildren(struct index_arena *arena,
+				struct index_node *node)
+{
+	int c = 0, alloc;
+	void *table;
+
+	while ((1 << c) <= node->child_count)
+		c++;
+	alloc = 1 << c;
+
+	table = arena->free_children[c];
+	if (table)
+		arena->free_children[c] = *(void **)table;
+	else
+		table = index__alloc(arena, alloc * (sizeof(struct index_node *)
+						     + 1),
+				     __alignof__(struct index_node *));
+
+	if (node->child_count) {
+		memcpy(table, node->children,
+		       node->child_count * sizeof(struct index_node *));
+		memcpy(table + alloc * sizeof(struct index_node *),
+		       node->child_chars, node->child_count);
+
+		/* recycle the old table */
+		*(void **)node->children = arena->free_children[c - 1];
+		arena->free_children[c - 1] = node->children;
+	}
+
+	node->children = table;
+	node->child_chars = table + alloc * sizeof(struct index_node *);
+	node->child_alloc = alloc;
+}
+
+static void index__addchild(struct index_arena *arena,
+			    struct index_node *node,
+			    int ch, struct index_node *child)
+{
+	int pos = index__childpos(node, ch);
+	int n = node->child_count - pos;
+
+	if (node->child_count == node->child_alloc)
+		index__growchildren(arena, node);
+
+	memmove(&node->children[pos + 1], &node->children[pos],
+		n * sizeof(struct index_node *));
+	memmove(&node->child_chars[pos + 1], &node->child_chars[pos], n);
+	node->children[pos] = child;
+	node->child_chars[pos] = ch;
+	node->child_count++;
+}
+
 int index_insert(struct index_node *node, const char *key,
 		 const char *value, unsigned int priority)
 {
+	struct index_root *root = index__root(node);
+	struct index_arena *arena = &root->arena;
 	int i = 0; /* index within str */
 	int ch;
 	
 	index__checkstring(key);
 	index__checkstring(value);
+	value = index__intern(root, value);
 	
 	while(1) {
+		struct index_node *child;
 		int j; /* index within node->prefix */
 	
 		/* Ensure node->prefix is a prefix of &str[i].
@@ -126,21 +391,22 @@ int index_insert(struct index_node *node, const char *key,
 			ch = node->prefix[j];
 		
 			if (ch != key[i+j]) {
-				char *prefix = node->prefix;
 				struct index_node *n;
 				
-				/* New child is copy of node with prefix[j+1..N] */
-				n = NOFAIL(calloc(sizeof(struct index_node), 1));
-				memcpy(n, node, sizeof(struct index_node));
-				n->prefix = NOFAIL(strdup(&prefix[j+1]));
+				/* New child is copy of node with prefix[j+1..N].
+				   The prefix is split in place. */
+				n = index__newnode(arena, &node->prefix[j+1]);
+				*n = *node;
+				n->prefix = &node->prefix[j+1];
 				
 				/* Parent has prefix[0..j], child at prefix[j] */
-				memset(node, 0, sizeof(struct index_node));
-				prefix[j] = '\0';
-				node->prefix = prefix;
-				node->first = ch;
-				node->last = ch;
-				node->children[ch] = n;
+				node->prefix[j] = '\0';
+				node->values = NULL;
+				node->child_count = 0;
+				node->child_alloc = 0;
+				node->children = NULL;
+				node->child_chars = NULL;
+				index__addchild(arena, node, ch, n);
 				
 				break;
 			}
@@ -150,177 +416,150 @@ int index_insert(struct index_node *node, const char *key,
 	
 		ch = key[i];
 		if(ch == '\0')
-			return add_value(&node->values, value, priority);
+			return add_value(&node->values,
+					 index__newvalue(arena, value, priority));
 		
-		if (!node->children[ch]) {
-			struct index_node *child;
-		
-			if (ch < node->first)
-				node->first = ch;
-			if (ch > node->last)
-				node->last = ch;
-			node->children[ch] = NOFAIL(calloc(sizeof(struct index_node), 1));
-			
-			child = node->children[ch];
-			child->prefix = NOFAIL(strdup(&key[i+1]));
-			child->first = INDEX_CHILDMAX;
-			add_value(&child->values, value, priority);
+		child = index__getchild(node, ch);
+		if (!child) {
+			child = index__newnode(arena,
+					       index__strdup(arena, &key[i+1]));
+			index__addchild(arena, node, ch, child);
+			add_value(&child->values,
+				  index__newvalue(arena, value, priority));
 
 			return 0;
 		}
 		
 		/* Descend into child node and continue */
-		node = node->children[ch];
+		node = child;
 		i++;
 	}
 }
 
-static int index__haschildren(const struct index_node *node)
+/* Find the node for key, or NULL if there is none */
+static struct index_node *index__find(const struct index_node *node,
+				      const char *key)
 {
-	return node->first < INDEX_CHILDMAX;
-}
-
-/* Recursive post-order traversal
+	while (node) {
+		int j;
 
-   Pre-order would make for better read-side buffering / readahead / caching.
-   (post-order means you go backwards in the file as you descend the tree).
-   However, index reading is already fast enough.
-   Pre-order is simpler for writing, and depmod is already slow.
- */
-static uint32_t index_write__node(const struct index_node *node, FILE *out)
-{
- 	uint32_t *child_offs = NULL;
- 	int child_count = 0;
-	long offset;
-	
-	if (!node)
-		return 0;
-	
-	/* Write children and save their offsets */
-	if (index__haschildren(node)) {
-		const struct index_node *child;
-		int i;
-		
-		child_count = node->last - node->first + 1;
-		child_offs = NOFAIL(malloc(child_count * sizeof(uint32_t)));
-		
-		for (i = 0; i < child_count; i++) {
-			child = node->children[node->first + i];
-			child_offs[i] = htonl(index_write__node(child, out));
+		for (j = 0; node->prefix[j]; j++) {
+			if (node->prefix[j] != key[j])
+				return NULL;
 		}
-	}
-		
-	/* Now write this node */
-	offset = ftell(out);
-	
-	if (node->prefix[0]) {
-		fputs(node->prefix, out);
-		fputc('\0', out);
-		offset |= INDEX_NODE_PREFIX;
-	}
-		
-	if (child_count) {
-		fputc(node->first, out);
-		fputc(node->last, out);
-		fwrite(child_offs, sizeof(uint32_t), child_count, out);
-		free(child_offs);
-		offset |= INDEX_NODE_CHILDS;
-	}
-	
-	if (node->values) {
-		const struct index_value *v;
-		unsigned int value_count;
-		uint32_t u;
-
-		value_count = 0;
-		for (v = node->values; v != NULL; v = v->next)
-			value_count++;
-		u = htonl(value_count);
-		fwrite(&u, sizeof(u), 1, out);
+		key += j;
 
-		for (v = node->values; v != NULL; v = v->next) {
-			u = htonl(v->priority);
-			fwrite(&u, sizeof(u), 1, out);
-			fputs(v->value, out);
-			fputc('\0', out);
-		}
-		offset |= INDEX_NODE_VALUES;
+		if (*key == '\0')
+			return (struct index_node *) node;
+		node = index__getchild(node, *key++);
 	}
-	
-	return offset;
+	return NULL;
 }
 
-void index_write(const struct index_node *node, FILE *out)
+const struct index_value *index_lookup(const struct index_node *node,
+				       const char *key)
 {
-	long initial_offset, final_offset;
-	uint32_t u;
-	
-	u = htonl(INDEX_MAGIC);
-	fwrite(&u, sizeof(u), 1, out);
-	u = htonl(INDEX_VERSION);
-	fwrite(&u, sizeof(u), 1, out);
-	
-	/* Second word is reserved for the offset of the root node */
-	initial_offset = ftell(out);
-	u = 0;
-	fwrite(&u, sizeof(uint32_t), 1, out);
-	
-	/* Dump trie */
-	u = htonl(index_write__node(node, out));
-	
-	/* Update first word */
-	final_offset = ftell(out);
-	fseek(out, initial_offset, SEEK_SET);
-	fwrite(&u, sizeof(uint32_t), 1, out);
-	fseek(out, final_offset, SEEK_SET);
+	node = index__find(node, key);
+	return node ? node->values : NULL;
 }
 
+/* After removing values below parent->children[pos], restore the shape the
+   trie would have if they had never been inserted: every node other than
+   the root has values or at least two children. */
+static void index__prune(struct index_arena *arena,
+			 struct index_node *parent, int pos)
+{
+	struct index_node *node = parent->children[pos];
+	struct index_node *child;
+	char *prefix;
 
+	if (node->values || node->child_count > 1)
+		return;
 
-static void read_error()
-{
-	fatal("Module index: unexpected error: %s\n"
-			"Try re-running depmod\n", errno ? strerror(errno) : "EOF");
+	if (node->child_count == 0) {
+		int n = parent->child_count - pos - 1;
+
+		memmove(&parent->children[pos], &parent->children[pos + 1],
+			n * sizeof(struct index_node *));
+		memmove(&parent->child_chars[pos],
+			&parent->child_chars[pos + 1], n);
+		parent->child_count--;
+		return;
+	}
+
+	/* Merge node with its only child */
+	child = node->children[0];
+	prefix = index__alloc(arena, strlen(node->prefix) + 1
+			      + strlen(child->prefix) + 1, 1);
+	sprintf(prefix, "%s%c%s", node->prefix, node->child_chars[0],
+		child->prefix);
+	child->prefix = prefix;
+	parent->children[pos] = child;
 }
 
-static int read_char(FILE *in)
+static int index__remove(struct index_arena *arena, struct index_node *node,
+			 const char *key, const char *value)
 {
-	int ch;
+	struct index_value **v;
+	int j, pos, removed = 0;
 
-	errno = 0;
-	ch = getc_unlocked(in);
-	if (ch == EOF)
-		read_error();
-	return ch;
+	for (j = 0; node->prefix[j]; j++) {
+		if (node->prefix[j] != key[j])
+			return 0;
+	}
+	key += j;
+
+	if (*key == '\0') {
+		for (v = &node->values; *v; ) {
+			if (streq((*v)->value, value)) {
+				*v = (*v)->next;
+				removed++;
+			} else
+				v = &(*v)->next;
+		}
+		return removed;
+	}
+
+	pos = index__childpos(node, *key);
+	if (pos == node->child_count || node->child_chars[pos] != *key)
+		return 0;
+
+	removed = index__remove(arena, node->children[pos], key + 1, value);
+	if (removed)
+		index__prune(arena, node, pos);
+	return removed;
 }
 
-static uint32_t read_long(FILE *in)
+int index_remove(struct index_node *node, const char *key, const char *value)
 {
-	uint32_t l;
+	return index__remove(&index__root(node)->arena, node, key, value);
+}
 
-	errno = 0;
-	if (fread(&l, sizeof(uint32_t), 1, in) <= 0)
-		read_error();
-	return ntohl(l);
+static int index__haschildren(const struct index_node *node)
+{
+	return node->child_count > 0;
 }
 
 /*
  * Buffer abstract data type
  *
- * Used internally to store the current path during tree traversal.
+ * Used internally to serialise the index before it is written out,
+ * and to store the current path during tree traversal.
  * They help build wildcard key strings to pass to fnmatch(),
  * as well as building values of matching keys.
  */
 
 struct buffer {
 	char *bytes;
-	unsigned size;
-	unsigned used;
+	size_t size;
+	size_t used;
 };
 
-static void buf__realloc(struct buffer *buf, unsigned size)
+static void buf__realloc(struct buffer *buf, size_t size)
 {
 	if (size > buf->size) {
+		if (size < buf->size * 2)
+			size = buf->size * 2;
 		buf->bytes = NOFAIL(realloc(buf->bytes, size));
 		buf->size = size;
 	}
@@ -341,28 +580,6 @@ static void buf_destroy(struct buffer *buf)
 	free(buf);
 }
 
-/* Destroy buffer and return a copy as a C string */
-static char *buf_detach(struct buffer *buf)
-{
-	char *bytes;
-
-	bytes = NOFAIL(realloc(buf->bytes, buf->used + 1));
-	bytes[buf->used] = '\0';
-
-	free(buf);
-	return bytes;
-}
-
-/* Return a C string owned by the buffer
-   (invalidated if the buffer is changed).
- */
-static const char *buf_str(struct buffer *buf)
-{
-	buf__realloc(buf, buf->used + 1);
-	buf->bytes[buf->used] = '\0';
-	return buf->bytes;
-}
-
 static int buf_fwrite(struct buffer *buf, FILE *out)
 {
 	return fwrite(buf->bytes, 1, buf->used, out);
@@ -387,18 +604,49 @@ static unsigned buf_pushchars(struct buffer *buf, const char *str)
 	return i;
 }
 
-/* like buf_pushchars(), but the string comes from a file */
-static unsigned buf_freadchars(struct buffer *buf, FILE *in)
+static void buf_pushmem(struct buffer *buf, const void *mem, size_t len)
 {
-	unsigned i = 0;
-	int ch;
+	buf__realloc(buf, buf->used + len);
+	memcpy(buf->bytes + buf->used, mem, len);
+	buf->used += len;
+}
 
-	while ((ch = read_char(in))) {
-		buf_pushchar(buf, ch);
-		i++;
-	}
+/* Integers are stored in network order */
+static void buf_pushlong(struct buffer *buf, uint32_t l)
+{
+	l = htonl(l);
+	buf_pushmem(buf, &l, sizeof(l));
+}
 
-	return i;
+/* Overwrite an integer previously reserved at offset */
+static void buf_putlong(struct buffer *buf, size_t offset, uint32_t l)
+{
+	l = htonl(l);
+	memcpy(buf->bytes + offset, &l, sizeof(l));
+}
+
+/* 64 bit integers are stored high word first */
+static void buf_pushquad(struct buffer *buf, uint64_t q)
+{
+	buf_pushlong(buf, q >> 32);
+	buf_pushlong(buf, q);
+}
+
+static void buf_putquad(struct buffer *buf, size_t offset, uint64_t q)
+{
+	buf_putlong(buf, offset, q >> 32);
+	buf_putlong(buf, offset + 4, q);
+}
+
+/* Reserve len zeroed bytes, returning their offset */
+static size_t buf_reserve(struct buffer *buf, size_t len)
+{
+	size_t offset = buf->used;
+
+	buf__realloc(buf, buf->used + len);
+	memset(buf->bytes + offset, 0, len);
+	buf->used += len;
+	return offset;
 }
 
 static void buf_popchar(struct buffer *buf)
@@ -411,252 +659,1189 @@ static void buf_popchars(struct buffer *buf, unsigned n)
 	buf->used -= n;
 }
 
-static void buf_clear(struct buffer *buf)
-{
-	buf->used = 0;
-}
-
 /*
- * Index file searching (used only by modprobe)
+ * Visit every key of an in-memory index which has values, in sorted order.
  */
 
-struct index_node_f {
-	FILE *file;
-	char *prefix;		/* path compression */
-	struct index_value *values;
-	unsigned char first;	/* range of child nodes */
-	unsigned char last;
-	uint32_t children[0];
-};
-
-static struct index_node_f *index_read(FILE *in, uint32_t offset)
+static void index_foreach__node(const struct index_node *node,
+				struct buffer *buf,
+				index_foreach_fn fn, void *data)
 {
-	struct index_node_f *node;
-	char *prefix;
-	int i, child_count = 0;
-
-	if ((offset & INDEX_NODE_MASK) == 0)
-		return NULL;
+	unsigned int pushed;
+	int i;
 
-	fseek(in, offset & INDEX_NODE_MASK, SEEK_SET);
-	
-	if (offset & INDEX_NODE_PREFIX) {
-		struct buffer *buf = buf_create();
-		buf_freadchars(buf, in);
-		prefix = buf_detach(buf);
-	} else
-		prefix = NOFAIL(strdup(""));
-		
-	if (offset & INDEX_NODE_CHILDS) {
-		char first = read_char(in);
-		char last = read_char(in);
-		child_count = last - first + 1;
-		
-		node = NOFAIL(malloc(sizeof(struct index_node_f) +
-				     sizeof(uint32_t) * child_count));
-		
-		node->first = first;
-		node->last = last;
+	pushed = buf_pushchars(buf, node->prefix);
 
-		for (i = 0; i < child_count; i++)
-			node->children[i] = read_long(in);
-	} else {
-		node = NOFAIL(malloc(sizeof(struct index_node_f)));
-		node->first = INDEX_CHILDMAX;
-		node->last = 0;
+	if (node->values) {
+		buf_pushchar(buf, '\0');
+		fn(buf->bytes, node->values, data);
+		buf_popchar(buf);
 	}
-	
-	node->values = NULL;
-	if (offset & INDEX_NODE_VALUES) {
-		int value_count;
-		struct buffer *buf = buf_create();
-		const char *value;
-		unsigned int priority;
-
-		value_count = read_long(in);
 
-		while (value_count--) {
-			priority = read_long(in);
-			buf_freadchars(buf, in);
-			value = buf_str(buf);
-			add_value(&node->values, value, priority);
-			buf_clear(buf);
-		}
-		buf_destroy(buf);
+	for (i = 0; i < node->child_count; i++) {
+		buf_pushchar(buf, node->child_chars[i]);
+		index_foreach__node(node->children[i], buf, fn, data);
+		buf_popchar(buf);
 	}
 
-	node->prefix = prefix;
-	node->file = in;
-	return node;
+	buf_popchars(buf, pushed);
 }
 
-static void index_close(struct index_node_f *node)
+void index_foreach(const struct index_node *node, index_foreach_fn fn,
+		   void *data)
 {
-	free(node->prefix);
-	index_values_free(node->values);
-	free(node);
-}
+	struct buffer *buf = buf_create();
 
-struct index_file {
-	FILE *file;
-	uint32_t root_offset;
-};
+	index_foreach__node(node, buf, fn, data);
+	buf_destroy(buf);
+}
 
-/* Failures are silent; modprobe will fall back to text files */
-struct index_file *index_file_open(const char *filename)
-{
-	FILE *file;
-	uint32_t magic, version;
-	struct index_file *new;
+/* Recursive pre-order traversal
 
-	file = fopen(filename, "r");
-	if (!file)
-		return NULL;
-	errno = EINVAL;
+   Each node is written before the subtrees of its children, so a reader
+   descending the tree only ever moves forwards through the file, and the
+   nodes visited by a lookup tend to share pages with their parent.
+   The child offsets are not known until the children have been written,
+   so the child table is reserved first and filled in afterwards.
 
-	magic = read_long(file);
-	if (magic != INDEX_MAGIC)
-		return NULL;
+   The whole index is built up in memory and offsets are simply positions
+   in the buffer, so it can be written out in one go.
 
-	version = read_long(file);
-	if (version >> 16 != INDEX_VERSION_MAJOR)
-		return NULL;
+   Value strings go in a separate string table, which follows the nodes.
+   Each string is added to it the first time it is used, so the layout
+   depends only on the contents of the tree.
 
-	new = NOFAIL(malloc(sizeof(struct index_file)));
-	new->file = file;
-	new->root_offset = read_long(new->file);
+   Offsets are written 32 bits wide if they fit, otherwise the index is
+   written again with 64 bit offsets.
+ */
+struct index_hashkey {
+	uint64_t key;		/* offset in the string table */
+	uint64_t node;		/* node offset, with flags */
+	uint32_t hash[3];	/* index__hash_key(key, 0..2) */
+};
 
-	errno = 0;
-	return new;
-}
+struct index_writer {
+	struct buffer *buf;
+	struct buffer *strings;
+	uint64_t *string_offsets;	/* 1 + offset in strings, by id */
+
+	int wide;			/* 64 bit offsets */
+	uint64_t narrow_max;		/* largest 32 bit node offset */
+	int overflow;			/* need wide offsets */
+
+	/* Only when writing a hash table */
+	struct buffer *key;		/* path to the current node */
+	struct index_hashkey *keys;
+	unsigned int key_count;
+	unsigned int key_alloc;
+};
 
-void index_file_close(struct index_file *index)
+static void index_write__offset(struct index_writer *w, uint64_t offset)
 {
-	fclose(index->file);
-	free(index);
+	if (w->wide)
+		buf_pushquad(w->buf, offset);
+	else
+		buf_pushlong(w->buf, offset);
 }
 
-
-static struct index_node_f *index_readroot(struct index_file *in)
+static void index_write__putoffset(struct index_writer *w, size_t pos,
+				   uint64_t offset)
 {
-	return index_read(in->file, in->root_offset);
+	if (w->wide)
+		buf_putquad(w->buf, pos, offset);
+	else
+		buf_putlong(w->buf, pos, offset);
 }
 
-static struct index_node_f *index_readchild(const struct index_node_f *parent,
-					    int ch)
+static uint64_t index_write__string(struct index_writer *w, const char *str)
 {
-	if (parent->first <= ch && ch <= parent->last)
-		return index_read(parent->file,
-		                       parent->children[ch - parent->first]);
-	else
-		return NULL;
+	uint64_t *offset = &w->string_offsets[index__string_id(str)];
+
+	if (!*offset) {
+		*offset = 1 + w->strings->used;
+		buf_pushchars(w->strings, str);
+		buf_pushchar(w->strings, '\0');
+	}
+	return *offset - 1;
 }
 
-/*
- * Dump all strings as lines in a plain text file.
- */
+static void index_write__addkey(struct index_writer *w, uint64_t node);
 
-static void index_dump_node(struct index_node_f *node,
-			    struct buffer *buf,
-			    FILE *out,
+static uint64_t index_write__node(const struct index_node *node,
+				  struct index_writer *w)
+{
+	struct buffer *buf = w->buf;
+	unsigned int pushed = 0;
+	size_t offset;
+	uint32_t flags = 0;
+	size_t child_table = 0;
+	int size = w->wide ? 8 : 4;
+	int first = 0, sparse = 0;
+	
+	if (!node || w->overflow)
+		return 0;
+	
+	offset = buf->used;
+	if (!w->wide && offset > w->narrow_max) {
+		w->overflow = 1;
+		return 0;
+	}
+	
+	if (node->prefix[0]) {
+		buf_pushchars(buf, node->prefix);
+		buf_pushchar(buf, '\0');
+		flags |= INDEX_NODE_PREFIX;
+	}
+		
+	/* Reserve space for the child offsets, using whichever
+	   of the dense and sparse formats is smaller */
+	if (index__haschildren(node)) {
+		int last = node->child_chars[node->child_count - 1];
+		int range;
+
+		first = node->child_chars[0];
+		range = last - first + 1;
+		sparse = 1 + (1 + size) * node->child_count < 2 + size * range;
+
+		if (sparse) {
+			buf_pushchar(buf, node->child_count);
+			buf_pushmem(buf, node->child_chars, node->child_count);
+			child_table = buf_reserve(buf,
+						  size * node->child_count);
+			flags |= INDEX_NODE_SPARSE;
+		} else {
+			buf_pushchar(buf, first);
+			buf_pushchar(buf, last);
+			child_table = buf_reserve(buf, size * range);
+		}
+		flags |= INDEX_NODE_CHILDS;
+	}
+	
+	if (node->values) {
+		const struct index_value *v;
+		unsigned int value_count;
+
+		value_count = 0;
+		for (v = node->values; v != NULL; v = v->next)
+			value_count++;
+		buf_pushlong(buf, value_count);
+
+		for (v = node->values; v != NULL; v = v->next) {
+			buf_pushlong(buf, v->priority);
+			index_write__offset(w, index_write__string(w, v->value));
+		}
+		flags |= INDEX_NODE_VALUES;
+	}
+	
+	/* Flags are in the high nibble of the offset */
+	if (w->wide)
+		offset |= (uint64_t) flags << 32;
+	else
+		offset |= flags;
+	
+	if (w->key) {
+		pushed = buf_pushchars(w->key, node->prefix);
+		if (node->values)
+			index_write__addkey(w, offset);
+	}
+	
+	/* Write children and fill in their offsets */
+	if (index__haschildren(node)) {
+		int i;
+
+		for (i = 0; i < node->child_count; i++) {
+			int slot = sparse ? i : node->child_chars[i] - first;
+
+			if (w->key)
+				buf_pushchar(w->key, node->child_chars[i]);
+			index_write__putoffset(w, child_table + size * slot,
+				index_write__node(node->children[i], w));
+			if (w->key)
+				buf_popchar(w->key);
+		}
+	}
+	
+	if (w->key)
+		buf_popchars(w->key, pushed);
+	return offset;
+}
+
+/*
+ * Minimal perfect hash of the keys, for exact lookups
+ *
+ * Keys are spread over buckets of about INDEX_HASH_LOAD keys each, by
+ * the first of three hashes of the key.  Then, largest bucket first, each
+ * bucket is given the smallest displacement d for which the slots of all
+ * its keys are free (see index__hash_slot()).  A lookup reads a single
+ * slot, which names the key (to check it) and its node.
+ */
+
+#define INDEX_HASH_LOAD 4
+#define INDEX_HASH_TRIES (1 << 20)
+
+/* FNV-1a, with the final mix from MurmurHash3 */
+static uint32_t index__hash_key(const char *key, uint32_t seed)
+{
+	uint32_t h = fnv_hash(key, seed);
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/* The slot of a key with hashes h1 and h2 in a bucket with displacement d.
+   Every slot is reachable, since d % n is added on. */
+static uint32_t index__hash_slot(uint32_t h1, uint32_t h2, uint32_t d,
+				 uint32_t n)
+{
+	return (h1 + (d / n) * h2 + d % n) % n;
+}
+
+static void index_write__addkey(struct index_writer *w, uint64_t node)
+{
+	struct index_hashkey *k;
+
+	if (w->key_count == w->key_alloc) {
+		w->key_alloc = w->key_alloc ? w->key_alloc * 2 : 256;
+		w->keys = NOFAIL(realloc(w->keys, w->key_alloc * sizeof(*k)));
+	}
+	k = &w->keys[w->key_count++];
+
+	buf_pushchar(w->key, '\0');
+	k->key = w->strings->used;
+	k->node = node;
+	k->hash[0] = index__hash_key(w->key->bytes, 0);
+	k->hash[1] = index__hash_key(w->key->bytes, 1);
+	k->hash[2] = index__hash_key(w->key->bytes, 2);
+	buf_pushmem(w->strings, w->key->bytes, w->key->used);
+	buf_popchar(w->key);
+}
+
+/* Returns 0 if no displacement was found for some bucket */
+static int index_write__hash(struct index_writer *w, unsigned int nbuckets)
+{
+	unsigned int n = w->key_count;
+	unsigned int *start = NOFAIL(calloc(nbuckets + 1, sizeof(unsigned int)));
+	unsigned int *members = NOFAIL(malloc((n + 1) * sizeof(unsigned int)));
+	unsigned int *order = NOFAIL(malloc(nbuckets * sizeof(unsigned int)));
+	unsigned int *sizes = NOFAIL(calloc(nbuckets, sizeof(unsigned int)));
+	uint32_t *displace = NOFAIL(calloc(nbuckets, sizeof(uint32_t)));
+	struct index_hashkey **slots = NOFAIL(calloc(n, sizeof(*slots)));
+	unsigned int slot[INDEX_HASH_LOAD * 8];
+	unsigned int i, b, size, max = 0;
+	int ok = 1;
+
+	/* Group the keys by bucket */
+	for (i = 0; i < n; i++)
+		sizes[w->keys[i].hash[0] % nbuckets]++;
+	for (b = 0; b < nbuckets; b++)
+		start[b + 1] = start[b] + sizes[b];
+	for (i = 0; i < n; i++) {
+		b = w->keys[i].hash[0] % nbuckets;
+		members[start[b + 1] - sizes[b]--] = i;
+	}
+	for (b = 0; b < nbuckets; b++) {
+		sizes[b] = start[b + 1] - start[b];
+		if (sizes[b] > max)
+			max = sizes[b];
+	}
+	if (max > sizeof(slot) / sizeof(slot[0]))
+		ok = 0;
+
+	/* Largest buckets first */
+	i = 0;
+	for (size = max; size > 0; size--)
+		for (b = 0; b < nbuckets; b++)
+			if (sizes[b] == size)
+				order[i++] = b;
+
+	for (b = 0; ok && b < i; b++) {
+		unsigned int bucket = order[b];
+		uint32_t d;
+
+		size = sizes[bucket];
+		for (d = 0; d < INDEX_HASH_TRIES; d++) {
+			unsigned int j, k;
+
+			for (j = 0; j < size; j++) {
+				struct index_hashkey *key;
+
+				key = &w->keys[members[start[bucket] + j]];
+				slot[j] = index__hash_slot(key->hash[1],
+							   key->hash[2], d, n);
+				if (slots[slot[j]])
+					break;
+				for (k = 0; k < j; k++)
+					if (slot[k] == slot[j])
+						break;
+				if (k < j)
+					break;
+			}
+			if (j == size)
+				break;
+		}
+		if (d == INDEX_HASH_TRIES) {
+			ok = 0;
+			break;
+		}
+
+		displace[bucket] = d;
+		while (size--)
+			slots[slot[size]] = &w->keys[members[start[bucket] + size]];
+	}
+
+	if (ok) {
+		buf_pushlong(w->buf, n);
+		buf_pushlong(w->buf, nbuckets);
+		for (b = 0; b < nbuckets; b++)
+			buf_pushlong(w->buf, displace[b]);
+		for (i = 0; i < n; i++) {
+			index_write__offset(w, slots[i]->key);
+			index_write__offset(w, slots[i]->node);
+		}
+	}
+
+	free(slots);
+	free(displace);
+	free(sizes);
+	free(order);
+	free(members);
+	free(start);
+	return ok;
+}
+
+/* The largest node offset in a narrow index */
+static uint64_t index__narrow_max(void)
+{
+#ifdef JUST_TESTING
+	/* Let the testsuite exercise wide indexes, without making huge ones */
+	if (getenv("MODTEST_INDEX_WIDE"))
+		return 0;
+#endif
+	return INDEX_NODE_MASK;
+}
+
+/* Serialise the index into w->buf.  Returns 0 if it needs wide offsets. */
+static int index_write__file(const struct index_node *node,
+			     struct index_writer *w)
+{
+	int size = w->wide ? 8 : 4;
+	size_t root_offset, strings_offset, hash_offset;
+	uint64_t root;
+	
+	buf_pushlong(w->buf, INDEX_MAGIC);
+	buf_pushlong(w->buf, w->wide ? INDEX_VERSION_WIDE : INDEX_VERSION);
+	
+	/* Reserve words for the offsets of the root node, the string table
+	   and the hash table */
+	root_offset = buf_reserve(w->buf, size);
+	strings_offset = buf_reserve(w->buf, size);
+	hash_offset = buf_reserve(w->buf, size);
+	
+	/* Dump trie */
+	root = index_write__node(node, w);
+	if (w->overflow)
+		return 0;
+	index_write__putoffset(w, root_offset, root);
+	
+	/* Then the strings it refers to */
+	index_write__putoffset(w, strings_offset, w->buf->used);
+	buf_pushmem(w->buf, w->strings->bytes, w->strings->used);
+	
+	/* The hash table is optional, so give up if it can't be built.
+	   Doubling the number of buckets makes that very unlikely. */
+	if (w->key_count) {
+		unsigned int nbuckets;
+		size_t used = w->buf->used;
+		
+		nbuckets = (w->key_count + INDEX_HASH_LOAD - 1) / INDEX_HASH_LOAD;
+		for (; nbuckets <= 16 * w->key_count; nbuckets *= 2) {
+			if (index_write__hash(w, nbuckets)) {
+				index_write__putoffset(w, hash_offset, used);
+				break;
+			}
+		}
+	}
+	
+	/* Every other offset is less than the size of the file */
+	return w->wide || w->buf->used <= UINT32_MAX;
+}
+
+static void index__write(const struct index_node *node, FILE *out,
+			 int hashed)
+{
+	unsigned int strings = index__root(node)->strings.count;
+	struct index_writer w;
+	
+	memset(&w, 0, sizeof(w));
+	w.buf = buf_create();
+	w.strings = buf_create();
+	w.string_offsets = NOFAIL(calloc(strings + 1, sizeof(uint64_t)));
+	w.narrow_max = index__narrow_max();
+	if (hashed)
+		w.key = buf_create();
+	
+	if (!index_write__file(node, &w)) {
+		/* Start again with wide offsets */
+		w.wide = 1;
+		w.overflow = 0;
+		w.buf->used = 0;
+		w.strings->used = 0;
+		memset(w.string_offsets, 0, (strings + 1) * sizeof(uint64_t));
+		w.key_count = 0;
+		if (w.key)
+			w.key->used = 0;
+		index_write__file(node, &w);
+	}
+	
+	buf_fwrite(w.buf, out);
+	if (w.key)
+		buf_destroy(w.key);
+	free(w.keys);
+	free(w.string_offsets);
+	buf_destroy(w.strings);
+	buf_destroy(w.buf);
+}
+
+void index_write(const struct index_node *node, FILE *out)
+{
+	index__write(node, out, 0);
+}
+
+/* Also write a hash table of the keys, for faster index_search() */
+void index_write_hashed(const struct index_node *node, FILE *out)
+{
+	index__write(node, out, 1);
+}
+
+/*
+ * Index file searching (used only by modprobe)
+ *
+ * The whole file is mapped into memory when it is opened.  Nodes are
+ * decoded in place: prefixes and values are pointers into the mapping,
+ * so walking the trie does not allocate or copy anything.
+ */
+
+struct index_file {
+	const unsigned char *map;
+	size_t size;
+	int wide;			/* 64 bit offsets */
+	uint64_t root_offset;
+	uint64_t strings_offset;	/* 0 if values are stored inline */
+	uint32_t hash_keys;		/* 0 if there is no hash table */
+	uint32_t hash_buckets;
+	const unsigned char *hash;	/* displacements, then slots */
+};
+
+struct index_node_f {
+	const struct index_file *file;
+	const char *prefix;		/* path compression */
+	unsigned char first;		/* range of child nodes */
+	unsigned char last;
+	unsigned char child_count;
+	const unsigned char *child_chars; /* sorted, or NULL if dense */
+	const unsigned char *children;	/* offsets [child_count] */
+	unsigned int value_count;
+	const unsigned char *values;	/* first value record */
+};
+
+static void read_error()
+{
+	fatal("Module index: unexpected end of file\n"
+			"Try re-running depmod\n");
+}
+
+/* Check that len bytes at pos lie within the mapping */
+static void index_check(const struct index_file *in,
+			const unsigned char *pos, size_t len)
+{
+	size_t offset = pos - in->map;
+
+	if (pos < in->map || offset > in->size || len > in->size - offset)
+		read_error();
+}
+
+static uint32_t read_long(const struct index_file *in,
+			  const unsigned char **pos)
+{
+	uint32_t l;
+
+	index_check(in, *pos, sizeof(uint32_t));
+	memcpy(&l, *pos, sizeof(uint32_t));
+	*pos += sizeof(uint32_t);
+	return ntohl(l);
+}
+
+/* Offsets are 32 bits, or 64 bits in wide indexes */
+static uint64_t read_offset(const struct index_file *in,
+			    const unsigned char **pos)
+{
+	uint64_t offset = read_long(in, pos);
+
+	if (in->wide)
+		offset = offset << 32 | read_long(in, pos);
+	return offset;
+}
+
+static const char *read_string(const struct index_file *in,
+			       const unsigned char **pos)
+{
+	const char *str = (const char *) *pos;
+	const unsigned char *end;
+
+	index_check(in, *pos, 0);
+	end = memchr(*pos, '\0', in->size - (*pos - in->map));
+	if (!end)
+		read_error();
+	*pos = end + 1;
+	return str;
+}
+
+/* Decode the node at offset.  Returns 0 for a null offset. */
+static int index_read(const struct index_file *in, uint64_t offset,
+		      struct index_node_f *node)
+{
+	const unsigned char *pos;
+	uint32_t flags;
+
+	/* Separate the flags from the file offset */
+	if (in->wide) {
+		flags = (offset >> 32) & INDEX_NODE_FLAGS;
+		offset &= INDEX_NODE_MASK_WIDE;
+	} else {
+		flags = offset & INDEX_NODE_FLAGS;
+		offset &= INDEX_NODE_MASK;
+	}
+
+	if (offset == 0)
+		return 0;
+	if (offset > in->size)
+		read_error();
+
+	pos = in->map + offset;
+	index_check(in, pos, 0);
+
+	if (flags & INDEX_NODE_PREFIX)
+		node->prefix = read_string(in, &pos);
+	else
+		node->prefix = "";
+
+	if ((flags & INDEX_NODE_CHILDS) && (flags & INDEX_NODE_SPARSE)) {
+		index_check(in, pos, 1);
+		node->child_count = *pos++;
+		index_check(in, pos, node->child_count);
+		if (node->child_count == 0)
+			read_error();
+
+		node->child_chars = pos;
+		node->first = pos[0];
+		node->last = pos[node->child_count - 1];
+		pos += node->child_count;
+	} else if (flags & INDEX_NODE_CHILDS) {
+		index_check(in, pos, 2);
+		node->first = pos[0];
+		node->last = pos[1];
+		pos += 2;
+		if (node->first > node->last)
+			read_error();
+
+		node->child_count = node->last - node->first + 1;
+		node->child_chars = NULL;
+	} else {
+		node->first = INDEX_CHILDMAX;
+		node->last = 0;
+		node->child_count = 0;
+		node->child_chars = NULL;
+	}
+
+	node->children = pos;
+	pos += (in->wide ? 8 : 4) * node->child_count;
+	index_check(in, node->children, pos - node->children);
+
+	if (flags & INDEX_NODE_VALUES) {
+		node->value_count = read_long(in, &pos);
+		node->values = pos;
+	} else {
+		node->value_count = 0;
+		node->values = NULL;
+	}
+
+	node->file = in;
+	return 1;
+}
+
+/* Decode the value record at *pos, and advance to the next one */
+static const char *index_read_value(const struct index_node_f *node,
+				    const unsigned char **pos,
+				    unsigned int *priority)
+{
+	const struct index_file *in = node->file;
+	const unsigned char *str;
+	uint64_t offset;
+
+	*priority = read_long(in, pos);
+	if (!in->strings_offset)
+		return read_string(in, pos);
+
+	offset = read_offset(in, pos);
+	if (offset >= in->size - in->strings_offset)
+		read_error();
+	str = in->map + in->strings_offset + offset;
+	return read_string(in, &str);
+}
+
+/* Failures are silent; modprobe will fall back to text files */
+struct index_file *index_file_open(const char *filename)
+{
+	int fd;
+	struct stat st;
+	void *map;
+	const unsigned char *pos;
+	uint32_t magic, version;
+	struct index_file *new;
+
+	fd = open(filename, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < 3 * sizeof(uint32_t)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	new = NOFAIL(malloc(sizeof(struct index_file)));
+	new->map = map;
+	new->size = st.st_size;
+
+	pos = new->map;
+	magic = read_long(new, &pos);
+	version = read_long(new, &pos);
+	if (magic != INDEX_MAGIC ||
+	    version >> 16 < INDEX_VERSION_MAJOR_OLDEST ||
+	    version >> 16 > INDEX_VERSION_MAJOR_WIDE) {
+		index_file_close(new);
+		errno = EINVAL;
+		return NULL;
+	}
+	new->wide = version >> 16 >= INDEX_VERSION_MAJOR_WIDE;
+	new->root_offset = read_offset(new, &pos);
+
+	/* Since version 4.0, values are kept in a string table */
+	new->strings_offset = 0;
+	if (version >> 16 >= 4) {
+		new->strings_offset = read_offset(new, &pos);
+		if (!new->strings_offset || new->strings_offset > new->size)
+			read_error();
+	}
+
+	/* Version 4.1 added an optional hash table */
+	new->hash_keys = 0;
+	if (version >= 0x00040001) {
+		uint64_t hash_offset = read_offset(new, &pos);
+		size_t slot_size = new->wide ? 16 : 8;
+
+		if (hash_offset) {
+			if (hash_offset > new->size)
+				read_error();
+			pos = new->map + hash_offset;
+			new->hash_keys = read_long(new, &pos);
+			new->hash_buckets = read_long(new, &pos);
+			new->hash = pos;
+			if (!new->hash_keys || !new->hash_buckets ||
+			    new->hash_buckets > new->size / 4 ||
+			    new->hash_keys > new->size / slot_size)
+				read_error();
+			index_check(new, pos, 4 * (size_t) new->hash_buckets);
+			index_check(new, pos + 4 * (size_t) new->hash_buckets,
+				    slot_size * new->hash_keys);
+		}
+	}
+
+	errno = 0;
+	return new;
+}
+
+void index_file_close(struct index_file *index)
+{
+	munmap((void *) index->map, index->size);
+	free(index);
+}
+
+
+static int index_readroot(const struct index_file *in,
+			  struct index_node_f *root)
+{
+	return index_read(in, in->root_offset, root);
+}
+
+/* Read the n'th entry of the child table, setting *ch to its character.
+   child may be the same node as parent. */
+static int index_readchild_nth(const struct index_node_f *parent, int n,
+			       int *ch, struct index_node_f *child)
+{
+	const unsigned char *pos;
+
+	if (parent->child_chars)
+		*ch = parent->child_chars[n];
+	else
+		*ch = parent->first + n;
+
+	pos = parent->children + (parent->file->wide ? 8 : 4) * n;
+	return index_read(parent->file, read_offset(parent->file, &pos), child);
+}
+
+/* child may be the same node as parent */
+static int index_readchild(const struct index_node_f *parent, int ch,
+			   struct index_node_f *child)
+{
+	const unsigned char *found;
+
+	if (ch < parent->first || ch > parent->last)
+		return 0;
+
+	if (!parent->child_chars)
+		return index_readchild_nth(parent, ch - parent->first,
+					   &ch, child);
+
+	/* Sparse tables are short; memchr() is vectorised in libc */
+	found = memchr(parent->child_chars, ch, parent->child_count);
+	if (!found)
+		return 0;
+	return index_readchild_nth(parent, found - parent->child_chars,
+				   &ch, child);
+}
+
+/*
+ * Dump all strings as lines in a plain text file.
+ */
+
+static void index_dump_node(const struct index_node_f *node,
+			    struct buffer *buf,
+			    FILE *out,
 			    const char *prefix)
 {
-	struct index_value *v;
+	const unsigned char *pos;
+	unsigned int i, priority;
 	int ch, pushed;
 	
 	pushed = buf_pushchars(buf, node->prefix);
 	
-	for (v = node->values; v != NULL; v = v->next) {
+	pos = node->values;
+	for (i = 0; i < node->value_count; i++) {
+		const char *value = index_read_value(node, &pos, &priority);
+
 		fputs(prefix, out);
 		buf_fwrite(buf, out);
 		fputc(' ', out);
-		fputs(v->value, out);
+		fputs(value, out);
 		fputc('\n', out);
 	}
 	
-	for (ch = node->first; ch <= node->last; ch++) {
-		struct index_node_f *child = index_readchild(node, ch);
+	for (i = 0; i < node->child_count; i++) {
+		struct index_node_f child;
 		
-		if (!child)
+		if (!index_readchild_nth(node, i, &ch, &child))
 			continue;
 			
 		buf_pushchar(buf, ch);
-		index_dump_node(child, buf, out, prefix);
+		index_dump_node(&child, buf, out, prefix);
 		buf_popchar(buf);
 	}
 	
 	buf_popchars(buf, pushed);
-	index_close(node);
 }
 
 void index_dump(struct index_file *in, FILE *out, const char *prefix)
 {
-	struct index_node_f *root;
+	struct index_node_f root;
 	struct buffer *buf;
 	
+	if (!index_readroot(in, &root))
+		return;
+
+	buf = buf_create();
+	index_dump_node(&root, buf, out, prefix);
+	buf_destroy(buf);
+}
+
+/*
+ * Read a whole index back into memory (used only by depmod)
+ */
+
+static void index_load_node(const struct index_node_f *node,
+			    struct buffer *buf,
+			    struct index_node *index)
+{
+	const unsigned char *pos;
+	const char **values;
+	unsigned int *priorities;
+	unsigned int i;
+	int ch, pushed;
+
+	pushed = buf_pushchars(buf, node->prefix);
+
+	if (node->value_count) {
+		values = NOFAIL(malloc(node->value_count * sizeof(*values)));
+		priorities = NOFAIL(malloc(node->value_count *
+					   sizeof(*priorities)));
+		pos = node->values;
+		for (i = 0; i < node->value_count; i++)
+			values[i] = index_read_value(node, &pos,
+						     &priorities[i]);
+
+		/* A value goes before others of the same priority, so
+		   insert them backwards to keep the order in the file */
+		buf_pushchar(buf, '\0');
+		for (i = node->value_count; i-- > 0; )
+			index_insert(index, buf->bytes, values[i],
+				     priorities[i]);
+		buf_popchar(buf);
+		free(values);
+		free(priorities);
+	}
+
+	for (i = 0; i < node->child_count; i++) {
+		struct index_node_f child;
+
+		if (!index_readchild_nth(node, i, &ch, &child))
+			continue;
+
+		buf_pushchar(buf, ch);
+		index_load_node(&child, buf, index);
+		buf_popchar(buf);
+	}
+
+	buf_popchars(buf, pushed);
+}
+
+struct index_node *index_file_load(struct index_file *in)
+{
+	struct index_node *index = index_create();
+	struct index_node_f root;
+	struct buffer *buf;
+
+	if (!index_readroot(in, &root))
+		return index;
+
 	buf = buf_create();
-	root = index_readroot(in);
-	index_dump_node(root, buf, out, prefix);
+	index_load_node(&root, buf, index);
 	buf_destroy(buf);
+	return index;
 }
 
 /*
  * Search the index for a key
  *
  * Returns the value of the first match
- *
- * The recursive functions free their node argument (using index_close).
  */
 
-char *index_search(struct index_file *in, const char *key);
-static char *index_search__node(struct index_node_f *node, const char *key, int i);
-
-char *index_search(struct index_file *in, const char *key)
+/* Find the node for key using the hash table.  Returns 0 if not found. */
+static int index_search__hash(const struct index_file *in, const char *key,
+			      struct index_node_f *node)
 {
-	struct index_node_f *root;
-	char *value;
-	
-	root = index_readroot(in);
-	value = index_search__node(root, key, 0);
-	
-	return value;
+	const unsigned char *pos;
+	uint32_t d, slot;
+	uint64_t key_offset;
+	const unsigned char *str;
+
+	pos = in->hash + 4 * (index__hash_key(key, 0) % in->hash_buckets);
+	d = read_long(in, &pos);
+	slot = index__hash_slot(index__hash_key(key, 1),
+				index__hash_key(key, 2), d, in->hash_keys);
+
+	pos = in->hash + 4 * (size_t) in->hash_buckets +
+		(in->wide ? 16 : 8) * (size_t) slot;
+	key_offset = read_offset(in, &pos);
+	if (key_offset >= in->size - in->strings_offset)
+		read_error();
+	str = in->map + in->strings_offset + key_offset;
+	if (!streq(read_string(in, &str), key))
+		return 0;
+
+	return index_read(in, read_offset(in, &pos), node);
 }
 
-static char *index_search__node(struct index_node_f *node, const char *key, int i)
+char *index_search(struct index_file *in, const char *key)
 {
-	char *value;
-	struct index_node_f *child;
-	int ch;
+	struct index_node_f node;
+	const unsigned char *pos;
+	unsigned int priority;
+	int i = 0;
 	int j;
 
-	while(node) {
-		for (j = 0; node->prefix[j]; j++) {
-			ch = node->prefix[j];
-			
-			if (ch != key[i+j]) {
-				index_close(node);
+	if (in->hash_keys) {
+		if (!index_search__hash(in, key, &node) || !node.value_count)
+			return NULL;
+
+		pos = node.values;
+		return NOFAIL(strdup(index_read_value(&node, &pos,
+						      &priority)));
+	}
+
+	if (!index_readroot(in, &node))
+		return NULL;
+
+	while(1) {
+		for (j = 0; node.prefix[j]; j++) {
+			if (node.prefix[j] != key[i+j])
 				return NULL;
-			}
 		}
 		i += j;
 		
 		if (key[i] == '\0') {
-			if (node->values) {
-				value = strdup(node->values[0].value);
-				index_close(node);
-				return value;
-			} else {
+			if (!node.value_count)
 				return NULL;
-			}
+
+			pos = node.values;
+			return NOFAIL(strdup(index_read_value(&node, &pos,
+							      &priority)));
 		}
 		
-		child = index_readchild(node, key[i]);
-		index_close(node);
-		node = child;
+		if (!index_readchild(&node, key[i], &node))
+			return NULL;
 		i++;
 	}
-	
-	return NULL;
+}
+
+/*
+ * Wildcard matching
+ *
+ * Rather than enumerating every key below a wildcard and passing each one
+ * to fnmatch(), the pattern spelt out by the path through the trie is
+ * matched against the key as the trie is walked.  The state of the match
+ * is the set of positions in the key up to which the pattern so far can
+ * match: a simulation of the pattern's NFA.  A subtree is skipped as soon
+ * as that set becomes empty.
+ *
+ * The syntax is that of fnmatch() with no flags.  Bracket expressions are
+ * collected from the path until they are closed, then evaluated by
+ * fnmatch() for each distinct character they might match.
+ */
+
+#define WILD_BITS (8 * sizeof(unsigned long))
+
+struct wildmatch {
+	const char *key;
+	unsigned int len;
+	unsigned int words;	/* size of each position set */
+	unsigned long *masks;	/* masks[c]: positions just after each c */
+	unsigned long *any;	/* positions 1..len */
+	struct buffer *pattern;	/* path from the first wildcard */
+	unsigned int start;	/* key position matched by the first wildcard */
+};
+
+struct wildstate {
+	unsigned long *set;	/* bit i: pattern matches key[0..i) */
+	unsigned int bracket;	/* 1 + position of an unclosed '[' */
+	int escape;		/* after an unescaped backslash */
+};
+
+static void wild_setbit(unsigned long *set, unsigned int i)
+{
+	set[i / WILD_BITS] |= 1UL << (i % WILD_BITS);
+}
+
+static int wild_testbit(const unsigned long *set, unsigned int i)
+{
+	return (set[i / WILD_BITS] >> (i % WILD_BITS)) & 1;
+}
+
+static int wild_empty(const struct wildmatch *m, const unsigned long *set)
+{
+	unsigned int w;
+
+	for (w = 0; w < m->words; w++)
+		if (set[w])
+			return 0;
+	return 1;
+}
+
+/* out = (in << 1) & mask: advance every position over one character */
+static void wild_advance(const struct wildmatch *m, const unsigned long *in,
+			 const unsigned long *mask, unsigned long *out)
+{
+	unsigned long carry = 0;
+	unsigned int w;
+
+	for (w = 0; w < m->words; w++) {
+		unsigned long word = in[w];
+
+		out[w] = ((word << 1) | carry) & mask[w];
+		carry = word >> (WILD_BITS - 1);
+	}
+}
+
+/* out = every position at or after the first one in in */
+static void wild_star(const struct wildmatch *m, const unsigned long *in,
+		      unsigned long *out)
+{
+	unsigned int w, seen = 0;
+
+	for (w = 0; w < m->words; w++) {
+		if (seen)
+			out[w] = ~0UL;
+		else if (in[w]) {
+			out[w] = ~((in[w] & -in[w]) - 1);
+			seen = 1;
+		} else
+			out[w] = 0;
+	}
+	/* Clear bits past the end of the key */
+	if (seen)
+		for (w = 0; w < m->words; w++)
+			out[w] &= m->any[w] | (w == 0);
+}
+
+static void wild_init(struct wildmatch *m, const char *key)
+{
+	unsigned int i;
+
+	m->key = key;
+	m->len = strlen(key);
+	m->words = m->len / WILD_BITS + 1;
+	m->masks = NOFAIL(calloc(256 + 1, m->words * sizeof(unsigned long)));
+	m->any = m->masks + 256 * m->words;
+	for (i = 0; i < m->len; i++) {
+		unsigned char c = key[i];
+
+		wild_setbit(&m->masks[c * m->words], i + 1);
+		wild_setbit(m->any, i + 1);
+	}
+	m->pattern = buf_create();
+}
+
+static void wild_free(struct wildmatch *m)
+{
+	free(m->masks);
+	buf_destroy(m->pattern);
+}
+
+/* Does the ']' at pattern[end] close the bracket opened at pattern[start]?
+
+   Brackets containing '[' (character classes and the like) or '\\' are
+   never closed here.  fnmatch() is rather particular about how those end,
+   so a pattern containing one is left to fnmatch() (see wild_accepts). */
+static int wild_bracket_closes(const struct wildmatch *m,
+			       unsigned int start, unsigned int end)
+{
+	const char *p = m->pattern->bytes;
+	unsigned int i = start + 1;
+
+	if (p[i] == '!' || p[i] == '^')
+		i++;
+	if (i == end)
+		return 0;	/* a leading ']' is part of the set */
+
+	for (; i < end; i++)
+		if (p[i] == '[' || p[i] == '\\')
+			return 0;
+	return 1;
+}
+
+/* Advance over the bracket expression pattern[start..end] */
+static void wild_bracket(const struct wildmatch *m,
+			 unsigned int start, unsigned int end,
+			 const unsigned long *in, unsigned long *out)
+{
+	unsigned long mask[m->words];
+	char bracket[end - start + 2];
+	signed char cache[256];
+	unsigned int i;
+
+	memcpy(bracket, m->pattern->bytes + start, end - start + 1);
+	bracket[end - start + 1] = '\0';
+	memset(cache, -1, sizeof(cache));
+	memset(mask, 0, sizeof(mask));
+
+	for (i = 0; i < m->len; i++) {
+		unsigned char c = m->key[i];
+		char str[2] = { c, '\0' };
+
+		if (!wild_testbit(in, i))
+			continue;
+		if (cache[c] < 0)
+			cache[c] = (fnmatch(bracket, str, 0) == 0);
+		if (cache[c])
+			wild_setbit(mask, i + 1);
+	}
+	wild_advance(m, in, mask, out);
+}
+
+/* Step over the pattern character at pattern[pos] */
+static void wild_step(const struct wildmatch *m, const struct wildstate *in,
+		      unsigned int pos, struct wildstate *out)
+{
+	unsigned char ch = m->pattern->bytes[pos];
+
+	out->bracket = 0;
+	out->escape = 0;
+
+	if (in->bracket) {
+		if (ch == ']' && wild_bracket_closes(m, in->bracket - 1, pos)) {
+			wild_bracket(m, in->bracket - 1, pos, in->set, out->set);
+		} else {
+			memcpy(out->set, in->set,
+			       m->words * sizeof(unsigned long));
+			out->bracket = in->bracket;
+		}
+		return;
+	}
+
+	if (in->escape) {
+		wild_advance(m, in->set, &m->masks[ch * m->words], out->set);
+		return;
+	}
+
+	switch (ch) {
+	case '*':
+		wild_star(m, in->set, out->set);
+		break;
+	case '?':
+		wild_advance(m, in->set, m->any, out->set);
+		break;
+	case '[':
+		memcpy(out->set, in->set, m->words * sizeof(unsigned long));
+		out->bracket = pos + 1;
+		break;
+	case '\\':
+		memcpy(out->set, in->set, m->words * sizeof(unsigned long));
+		out->escape = 1;
+		break;
+	default:
+		wild_advance(m, in->set, &m->masks[ch * m->words], out->set);
+	}
+}
+
+/* Does the pattern, ending here, match the whole key? */
+static int wild_accepts(const struct wildmatch *m, const struct wildstate *st)
+{
+	int match;
+
+	/* A trailing backslash never matches */
+	if (st->escape)
+		return 0;
+
+	if (!st->bracket)
+		return wild_testbit(st->set, m->len);
+
+	/* Leave unclosed brackets to fnmatch() */
+	buf_pushchar(m->pattern, '\0');
+	match = fnmatch(m->pattern->bytes, m->key + m->start, 0) == 0;
+	buf_popchar(m->pattern);
+	return match;
 }
 
 /*
@@ -670,80 +1855,98 @@ struct index_value *index_searchwild(struct index_file *in, const char *key);
 
 /* Level 2: descend the tree (until we hit a wildcard) */
 static void index_searchwild__node(struct index_node_f *node,
-				   struct buffer *buf,
-				   const char *key, int i,
+				   struct wildmatch *m, int i,
 				   struct index_value **out);
 
 /* Level 3: traverse a sub-keyspace which starts with a wildcard,
             looking for matches.
 */
-static void index_searchwild__all(struct index_node_f *node, int j,
-				  struct buffer *buf,
-				  const char *subkey,
+static void index_searchwild__all(const struct index_node_f *node, int j,
+				  struct wildmatch *m,
+				  const struct wildstate *state,
 				  struct index_value **out);
 
 /* Level 4: add all the values from a matching node */
-static void index_searchwild__allvalues(struct index_node_f *node,
+static void index_searchwild__allvalues(const struct index_node_f *node,
 					struct index_value **out);
 
 
 struct index_value *index_searchwild(struct index_file *in, const char *key)
 {
-	struct index_node_f *root = index_readroot(in);
-	struct buffer *buf = buf_create();
+	struct index_node_f root;
+	struct wildmatch m;
 	struct index_value *out = NULL;
 	
-	index_searchwild__node(root, buf, key, 0, &out);
-	buf_destroy(buf);
+	if (!index_readroot(in, &root))
+		return NULL;
+
+	wild_init(&m, key);
+	index_searchwild__node(&root, &m, 0, &out);
+	wild_free(&m);
 	return out;
 }
 
+/* Start matching at key[i], from the wildcard at node->prefix[j] or,
+   if node is a child reached by a wildcard, from that character. */
+static void index_searchwild__start(const struct index_node_f *node, int j,
+				    int wildcard, struct wildmatch *m, int i,
+				    struct index_value **out)
+{
+	unsigned long set[2][m->words];
+	struct wildstate start, state;
+
+	memset(set[0], 0, sizeof(set[0]));
+	wild_setbit(set[0], i);
+	m->start = i;
+	start.set = set[0];
+	start.bracket = 0;
+	start.escape = 0;
+
+	if (!wildcard) {
+		index_searchwild__all(node, j, m, &start, out);
+		return;
+	}
+
+	state.set = set[1];
+	buf_pushchar(m->pattern, wildcard);
+	wild_step(m, &start, m->pattern->used - 1, &state);
+	if (!wild_empty(m, state.set))
+		index_searchwild__all(node, 0, m, &state, out);
+	buf_popchar(m->pattern);
+}
+
 static void index_searchwild__node(struct index_node_f *node,
-				   struct buffer *buf,
-				   const char *key, int i,
+				   struct wildmatch *m, int i,
 				   struct index_value **out)
 {
-	struct index_node_f *child;
+	const char *key = m->key;
+	struct index_node_f child;
 	int j;
 	int ch;
 
-	while(node) {
+	while(1) {
 		for (j = 0; node->prefix[j]; j++) {
 			ch = node->prefix[j];
 			
 			if (ch == '*' || ch == '?' || ch == '[') {
-				index_searchwild__all(node, j, buf,
-						      &key[i+j], out);
+				index_searchwild__start(node, j, 0, m, i+j,
+							out);
 				return;
 			}
 			
-			if (ch != key[i+j]) {
-				index_close(node);
+			if (ch != key[i+j])
 				return;
-			}
 		}
 		i += j;
 		
-		child = index_readchild(node, '*');
-		if (child) {
-			buf_pushchar(buf, '*');
-			index_searchwild__all(child, 0, buf, &key[i], out);
-			buf_popchar(buf);
-		}
+		if (index_readchild(node, '*', &child))
+			index_searchwild__start(&child, 0, '*', m, i, out);
 		
-		child = index_readchild(node, '?');
-		if (child) {
-			buf_pushchar(buf, '?');
-			index_searchwild__all(child, 0, buf, &key[i], out);
-			buf_popchar(buf);
-		}
+		if (index_readchild(node, '?', &child))
+			index_searchwild__start(&child, 0, '?', m, i, out);
 		
-		child = index_readchild(node, '[');
-		if (child) {
-			buf_pushchar(buf, '[');
-			index_searchwild__all(child, 0, buf, &key[i], out);
-			buf_popchar(buf);
-		}
+		if (index_readchild(node, '[', &child))
+			index_searchwild__start(&child, 0, '[', m, i, out);
 		
 		if (key[i] == '\0') {
 			index_searchwild__allvalues(node, out);
@@ -751,57 +1954,68 @@ static void index_searchwild__node(struct index_node_f *node,
 			return;
 		}
 		
-		child = index_readchild(node, key[i]);
-		index_close(node);
-		node = child;
+		if (!index_readchild(node, key[i], node))
+			return;
 		i++;
 	}
 }
 
-static void index_searchwild__all(struct index_node_f *node, int j,
-				  struct buffer *buf,
-				  const char *subkey,
+static void index_searchwild__all(const struct index_node_f *node, int j,
+				  struct wildmatch *m,
+				  const struct wildstate *state,
 				  struct index_value **out)
 {
+	unsigned long set[2][m->words];
+	struct wildstate cur, next;
 	int pushed = 0;
-	int ch;
+	int i, ch, n = 0;
 	
+	cur = *state;
 	while (node->prefix[j]) {
 		ch = node->prefix[j];
 		
-		buf_pushchar(buf, ch);
+		buf_pushchar(m->pattern, ch);
 		pushed++;
 		j++;
+
+		next.set = set[n];
+		n = !n;
+		wild_step(m, &cur, m->pattern->used - 1, &next);
+		cur = next;
+		if (wild_empty(m, cur.set))
+			goto out;
 	}
 
-	for (ch = node->first; ch <= node->last; ch++) {
-		struct index_node_f *child = index_readchild(node, ch);
+	next.set = set[n];
+	for (i = 0; i < node->child_count; i++) {
+		struct index_node_f child;
 		
-		if (!child)
+		if (!index_readchild_nth(node, i, &ch, &child))
 			continue;
 			
-		buf_pushchar(buf, ch);
-		index_searchwild__all(child, 0, buf, subkey, out);
-		buf_popchar(buf);
+		buf_pushchar(m->pattern, ch);
+		wild_step(m, &cur, m->pattern->used - 1, &next);
+		if (!wild_empty(m, next.set))
+			index_searchwild__all(&child, 0, m, &next, out);
+		buf_popchar(m->pattern);
 	}
 	
-	if (node->values) {
-		if (fnmatch(buf_str(buf), subkey, 0) == 0)
-			index_searchwild__allvalues(node, out);
-	} else {
-		index_close(node);
-	}
+	if (node->value_count && wild_accepts(m, &cur))
+		index_searchwild__allvalues(node, out);
 	
-	buf_popchars(buf, pushed);
+out:
+	buf_popchars(m->pattern, pushed);
 }
 
-static void index_searchwild__allvalues(struct index_node_f *node,
+static void index_searchwild__allvalues(const struct index_node_f *node,
 					struct index_value **out)
 {
-	struct index_value *v;
+	const unsigned char *pos = node->values;
+	unsigned int i, priority;
 	
-	for (v = node->values; v != NULL; v = v->next)
-		add_value(out, v->value, v->priority);
+	for (i = 0; i < node->value_count; i++) {
+		const char *value = index_read_value(node, &pos, &priority);
 
-	index_close(node);
+		add_value(out, index__newvalue(NULL, value, priority));
+	}
 }
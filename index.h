@@ -34,9 +34,24 @@
  * case we ever decide to have minor changes that are not incompatible.
  */
 
-#define INDEX_VERSION_MAJOR 0x0002
+/* Versions:
+ *   2.1: original layout, nodes written in post-order
+ *   2.2: nodes written in pre-order (a parent precedes its children)
+ *   3.0: sparse child tables (INDEX_NODE_SPARSE)
+ *   4.0: values are offsets into a table of distinct strings
+ *   4.1: optional hash table for exact lookups
+ *   5.0: as 4.1, with 64 bit offsets ("wide")
+ *
+ * depmod writes version 5.0 only for indexes too big for 32 bit offsets.
+ * Readers accept every major version from INDEX_VERSION_MAJOR_OLDEST to
+ * INDEX_VERSION_MAJOR_WIDE.
+ */
+#define INDEX_VERSION_MAJOR_OLDEST 0x0002
+#define INDEX_VERSION_MAJOR 0x0004
 #define INDEX_VERSION_MINOR 0x0001
 #define INDEX_VERSION ((INDEX_VERSION_MAJOR<<16)|INDEX_VERSION_MINOR)
+#define INDEX_VERSION_MAJOR_WIDE 0x0005
+#define INDEX_VERSION_WIDE (INDEX_VERSION_MAJOR_WIDE<<16)
 
 /* The index file maps keys to values. Both keys and values are ASCII strings.
    Each key can have multiple values. Values are sorted by an integer priority.
@@ -103,18 +118,24 @@
 struct index_value {
 	struct index_value *next;
 	unsigned int priority;
-	char value[0];
+	const char *value;
 };
 
-/* In-memory index (depmod only) */
+/* In-memory index (depmod only)
+
+   Children are kept in a table sorted by character, which grows as
+   children are added.  Nodes are allocated from an arena owned by the
+   root node (see index_create()).
+*/
 
 #define INDEX_CHILDMAX 128
 struct index_node {
 	char *prefix;		/* path compression */
 	struct index_value *values;
-	unsigned char first;	/* range of child nodes */
-	unsigned char last;
-	struct index_node *children[INDEX_CHILDMAX]; /* indexed by character */
+	unsigned char child_count;
+	unsigned char child_alloc;
+	unsigned char *child_chars;	/* sorted */
+	struct index_node **children;	/* children[i] is for child_chars[i] */
 };
 
 /* Disk format:
@@ -122,6 +143,8 @@ struct index_node {
    uint32_t magic = INDEX_MAGIC;
    uint32_t version = INDEX_VERSION;
    uint32_t root_offset;
+   uint32_t strings_offset; // since version 4.0
+   uint32_t hash_offset; // since version 4.1, 0 if there is no hash table
 
    (node_offset & INDEX_NODE_MASK) specifies the file offset of nodes:
 
@@ -130,18 +153,53 @@ struct index_node {
         char first;
         char last;
         uint32_t children[last - first + 1];
+    or, for sparse nodes:
+        unsigned char child_count;
+        char chars[child_count]; // sorted
+        uint32_t children[child_count];
 
         uint32_t value_count;
         struct {
             uint32_t priority;
-            char[] value; // nul terminated
+            uint32_t value; // offset from strings_offset
         } values[value_count];
 
+   Before version 4.0 each value was stored in place as a nul terminated
+   string, rather than as an offset.
+
+   The string table at strings_offset holds each distinct value once,
+   as nul terminated strings.
+
+   The hash table is a minimal perfect hash of the keys which have values:
+
+        uint32_t key_count;
+        uint32_t bucket_count;
+        uint32_t displacements[bucket_count];
+        struct {
+            uint32_t key; // offset from strings_offset
+            uint32_t node; // node offset, as above
+        } slots[key_count];
+
+   A key is in bucket hash(key, 0) % bucket_count.  If present, it is in slot
+   (hash(key, 1) + (d / key_count) * hash(key, 2) + d % key_count) % key_count
+   where d = displacements[bucket], computed in 32 bits.  hash() is FNV-1a
+   starting from (2166136261 ^ seed), followed by the final mix of MurmurHash3.
+
+   Readers which only need the trie can ignore the hash table.
+
    (node_offset & INDEX_NODE_FLAGS) indicates which fields are present.
    Empty prefixes are ommitted, leaf nodes omit the three child-related fields.
 
-   This could be optimised further by adding a sparse child format
-   (indicated using a new flag).
+   Nodes may appear in any order, since all offsets are absolute.  Since
+   minor version 2 the root node comes first and each node is followed by
+   the subtrees of its children, so lookups read forwards through the file.
+
+   Sparse nodes list only the characters which have a child; depmod uses
+   whichever child format takes less space.
+
+   Wide indexes (version 5) are the same except that every offset (in the
+   header, child tables, values and hash slots) is a uint64_t, with the
+   node flags in the high nibble of the high word.
  */
 
 /* Format of node offsets within index file */
@@ -150,10 +208,14 @@ enum node_offset {
 	INDEX_NODE_PREFIX   = 0x80000000,
 	INDEX_NODE_VALUES = 0x40000000,
 	INDEX_NODE_CHILDS   = 0x20000000,
+	INDEX_NODE_SPARSE   = 0x10000000, /* with INDEX_NODE_CHILDS */
 
 	INDEX_NODE_MASK     = 0x0FFFFFFF, /* Offset value */
 };
 
+/* In wide indexes the flags are shifted up to the high word */
+#define INDEX_NODE_MASK_WIDE 0x0FFFFFFFFFFFFFFFULL
+
 struct index_file;
 
 struct index_node *index_create(void);
@@ -161,10 +223,31 @@ void index_destroy(struct index_node *node);
 int index_insert(struct index_node *node, const char *key,
 		 const char *value, unsigned int priority);
 void index_write(const struct index_node *node, FILE *out);
+void index_write_hashed(const struct index_node *node, FILE *out);
+
+/* Values of exactly key, or NULL */
+const struct index_value *index_lookup(const struct index_node *node,
+				       const char *key);
+
+/* Remove every copy of value from key, returning how many were removed.
+   The tree is left as if they had never been inserted. */
+int index_remove(struct index_node *node, const char *key, const char *value);
+
+/* Call fn for each key with values, in sorted order.
+   fn must not modify the index. */
+typedef void (*index_foreach_fn)(const char *key,
+				 const struct index_value *values,
+				 void *data);
+void index_foreach(const struct index_node *node, index_foreach_fn fn,
+		   void *data);
 
 struct index_file *index_file_open(const char *filename);
 void index_file_close(struct index_file *index);
 
+/* Read a whole index file into a new in-memory index, with the values
+   of each key in the same order (depmod only) */
+struct index_node *index_file_load(struct index_file *in);
+
 /* Dump all strings in index as lines in a plain text file
    (prefix is prepended to each line)
 */
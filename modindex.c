@@ -8,7 +8,7 @@
 #include "logging.h"
 #include "index.h"
 
-static void write_index(const char *filename)
+static void write_index(const char *filename, int hashed)
 {
 	struct index_node *index;
 	char *line, *pos;
@@ -29,7 +29,10 @@ static void write_index(const char *filename)
 		free(line);
 	}
 	
-	index_write(index, cfile);
+	if (hashed)
+		index_write_hashed(index, cfile);
+	else
+		index_write(index, cfile);
 	index_destroy(index);
 	fclose(cfile);
 }
@@ -97,6 +100,7 @@ static void print_usage(const char *progname)
 	fprintf(stderr,
 		"Usage: %s [MODE] [FILE] ...\n"
 		" -o, --output <outfile>\n"
+		" -H, --hash (with --output: add a hash table)\n"
 		" -d, --dump <infile>\n"
 		" -s, --search <key> <infile>\n"
 		" -w, --searchwild <key> <infile>\n"
@@ -106,24 +110,30 @@ static void print_usage(const char *progname)
 
 static const struct option options[] = {
 	{ "output", 0, NULL, 'o' },
+	{ "hash", 0, NULL, 'H' },
 	{ "dump", 0, NULL, 'd' },
 	{ "search", 1, NULL, 's' },
 	{ "searchwild", 1, NULL, 'w' },
+	{ NULL, 0, NULL, 0 }
 };
 
 int main(int argc, char *argv[])
 {
 	int opt;
 	char mode = 0;
+	int hashed = 0;
 	char *filename = NULL;
 	char *key = NULL;
 	
-	while ((opt = getopt_long(argc, argv, "ods:w:", options, NULL))
+	while ((opt = getopt_long(argc, argv, "oHds:w:", options, NULL))
 		       != -1) {
 		switch (opt) {
 			case 'o':
 				mode = 'o';
 				break;
+			case 'H':
+				hashed = 1;
+				break;
 			case 'd':
 				mode = 'd';
 				break;
@@ -148,7 +158,7 @@ int main(int argc, char *argv[])
 	
 	switch(mode) {
 		case 'o':
-			write_index(filename);
+			write_index(filename, hashed);
 			break;
 		case 'd':
 			dump_index(filename);
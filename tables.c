@@ -51,7 +51,7 @@ int output_pci_table(struct module *modules, FILE *out, char *dirname)
 
 		make_shortname(shortname, i->pathname);
 		for (e = t->pci_table; e->vendor; e = (void *)e + t->pci_size)
-			output_pci_entry(e, shortname, out, i->file->conv);
+			output_pci_entry(e, shortname, out, i->tables.conv);
 	}
 	return 1;
 }
@@ -103,7 +103,7 @@ int output_usb_table(struct module *modules, FILE *out, char *dirname)
 		for (e = t->usb_table;
 		     e->idVendor || e->bDeviceClass || e->bInterfaceClass;
 		     e = (void *)e + t->usb_size)
-			output_usb_entry(e, shortname, out, i->file->conv);
+			output_usb_entry(e, shortname, out, i->tables.conv);
 	}
 	return 1;
 }
@@ -138,7 +138,7 @@ int output_ieee1394_table(struct module *modules, FILE *out, char *dirname)
 		make_shortname(shortname, i->pathname);
 		for (fw = t->ieee1394_table; fw->match_flags;
 		     fw = (void *) fw + t->ieee1394_size)
-			output_ieee1394_entry(fw, shortname, out, i->file->conv);
+			output_ieee1394_entry(fw, shortname, out, i->tables.conv);
 	}
 	return 1;
 }
@@ -173,7 +173,7 @@ int output_ccw_table(struct module *modules, FILE *out, char *dirname)
 		for (e = t->ccw_table;
 		     e->cu_type || e->cu_model || e->dev_type || e->dev_model;
 		     e = (void *) e + t->ccw_size)
-			output_ccw_entry(e, shortname, out, i->file->conv);
+			output_ccw_entry(e, shortname, out, i->tables.conv);
 	}
 	return 1;
 }
@@ -430,7 +430,7 @@ int output_input_table(struct module *modules, FILE *out, char *dirname)
 		char shortname[strlen(i->pathname) + 1];
 		int done = 0;
 		struct module_tables *t = &i->tables;
-		int conv = i->file->conv;
+		int conv = i->tables.conv;
 
 		if (!t->input_table)
 			continue;
@@ -17,6 +17,7 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <time.h>
+#include <sys/inotify.h>
 
 /* We don't use all of these. */
 static int modtest_uname(struct utsname *buf) __attribute__((unused));
@@ -43,6 +44,8 @@ static int modtest_readlink(const char *path, char *buf, size_t bufsiz)
 __attribute__((unused));
 static int modtest_unlink(const char *path)
 __attribute__((unused));
+static int modtest_inotify_add_watch(int fd, const char *path, uint32_t mask)
+__attribute__((unused));
 
 static int modtest_uname(struct utsname *buf)
 {
@@ -225,6 +228,14 @@ static int modtest_unlink(const char *path)
 	return unlink(path);
 }
 
+static int modtest_inotify_add_watch(int fd, const char *path, uint32_t mask)
+{
+	char path_buf[PATH_MAX];
+
+	path = modtest_mapname(path, path_buf, sizeof(path_buf));
+	return inotify_add_watch(fd, path, mask);
+}
+
 #ifdef CONFIG_USE_ZLIB
 #include <zlib.h>
 static gzFile *modtest_gzopen(const char *path, const char *mode)
@@ -255,6 +266,7 @@ static gzFile *modtest_gzopen(const char *path, const char *mode)
 #define rename modtest_rename
 #define readlink modtest_readlink
 #define unlink modtest_unlink
+#define inotify_add_watch modtest_inotify_add_watch
 #define gzopen modtest_gzopen
 
 #endif /* JUST_TESTING */
@@ -153,5 +153,12 @@ rm -f $MODULE_DIR/kernel/export_nodep-$BITNESS.ko
 rm -f $MODULE_DIR/modules*
 done # override
 
+# An update which can't be read doesn't hide the module it would override.
+ln tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko $MODULE_DIR/kernel
+rm $MODULE_DIR/updates/export_nodep-$BITNESS.ko
+echo "not a module" > $MODULE_DIR/updates/export_nodep-$BITNESS.ko
+[ "`depmod 2>&1`" = "WARNING: Can't read module /lib/modules/$MODTEST_UNAME/updates/export_nodep-$BITNESS.ko: Exec format error" ]
+[ "`grep -w export_nodep-$BITNESS.ko: $MODULE_DIR/modules.dep`" = "kernel/export_nodep-$BITNESS.ko:" ]
+
 done # 32/64-bit
 done
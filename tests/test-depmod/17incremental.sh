@@ -0,0 +1,98 @@
+#! /bin/sh
+# Test depmod -i gives the same output files as a full run.
+
+for ENDIAN in $TEST_ENDIAN; do
+for BITNESS in $TEST_BITS; do
+
+rm -rf tests/tmp/*
+
+# Create inputs
+MODULE_DIR=tests/tmp/lib/modules/$MODTEST_UNAME
+mkdir -p $MODULE_DIR/kernel $MODULE_DIR/updates tests/tmp/full tests/tmp/spare
+ln tests/data/$BITNESS$ENDIAN/normal/export_dep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/noexport_dep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/noexport_nodep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/noexport_doubledep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/alias/alias-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/modinfo/modinfo-$BITNESS.ko \
+   $MODULE_DIR/kernel
+
+KERNEL=/lib/modules/$MODTEST_UNAME/kernel
+UPDATES=/lib/modules/$MODTEST_UNAME/updates
+
+# So that a full run puts them all in a known order
+for MOD in modinfo export_nodep noexport_doubledep export_dep alias \
+    noexport_nodep noexport_dep; do
+	echo kernel/$MOD-$BITNESS.ko
+done > $MODULE_DIR/modules.order
+
+# Run depmod -a, keeping the files to compare against
+full()
+{
+	[ "`depmod 2>&1`" = "" ]
+	rm -f tests/tmp/full/*
+	cp $MODULE_DIR/modules.* tests/tmp/full
+	rm tests/tmp/full/modules.cache tests/tmp/full/modules.stamp
+}
+
+same_as_full()
+{
+	for FILE in tests/tmp/full/*; do
+		cmp $MODULE_DIR/`basename $FILE` $FILE
+	done
+}
+
+# New modules which nothing depends on: updated in place.
+for MOD in noexport_doubledep alias modinfo; do
+    full
+    mv $MODULE_DIR/kernel/$MOD-$BITNESS.ko tests/tmp/spare
+    [ "`depmod 2>&1`" = "" ]
+    mv tests/tmp/spare/$MOD-$BITNESS.ko $MODULE_DIR/kernel
+
+    [ "`depmod -i $KERNEL/$MOD-$BITNESS.ko 2>&1`" = "" ]
+    same_as_full
+    grep -q "^kernel/$MOD-$BITNESS.ko:" $MODULE_DIR/modules.dep
+done
+
+# Replacing a module others depend on changes their deps too.
+ln tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko $MODULE_DIR/updates
+full
+rm $MODULE_DIR/updates/export_nodep-$BITNESS.ko
+[ "`depmod 2>&1`" = "" ]
+ln tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko $MODULE_DIR/updates
+
+[ "`depmod -i $UPDATES/export_nodep-$BITNESS.ko 2>&1`" = "" ]
+same_as_full
+grep -q "^kernel/noexport_dep-$BITNESS.ko: updates/export_nodep-$BITNESS.ko$" $MODULE_DIR/modules.dep
+
+# An overridden module changes nothing.
+[ "`depmod -i $KERNEL/export_nodep-$BITNESS.ko 2>&1`" = "" ]
+same_as_full
+
+# Text files which don't match the indexes: full run.
+echo "kernel/missing-$BITNESS.ko:" >> $MODULE_DIR/modules.dep
+[ "`depmod -i $KERNEL/export_nodep-$BITNESS.ko 2>&1`" = "" ]
+same_as_full
+
+# Nothing knows who was missing a newly exported symbol: full run.
+rm $MODULE_DIR/updates/export_nodep-$BITNESS.ko
+full
+mv $MODULE_DIR/kernel/export_nodep-$BITNESS.ko tests/tmp/spare
+[ "`depmod 2>&1`" = "" ]
+mv tests/tmp/spare/export_nodep-$BITNESS.ko $MODULE_DIR/kernel
+
+[ "`depmod -i $KERNEL/export_nodep-$BITNESS.ko 2>&1`" = "" ]
+same_as_full
+grep -q "^kernel/noexport_dep-$BITNESS.ko: kernel/export_nodep-$BITNESS.ko$" $MODULE_DIR/modules.dep
+
+# Likewise without any indexes to start from.
+mv $MODULE_DIR/modules.order tests/tmp/spare
+rm $MODULE_DIR/modules.*
+mv tests/tmp/spare/modules.order $MODULE_DIR
+[ "`depmod -i $KERNEL/export_dep-$BITNESS.ko 2>&1`" = "" ]
+same_as_full
+[ `grep -vc '^#' < $MODULE_DIR/modules.dep` = 7 ]
+
+done
+done
@@ -0,0 +1,43 @@
+#! /bin/sh
+# Test depmod gives the same output whatever the number of threads.
+
+for ENDIAN in $TEST_ENDIAN; do
+for BITNESS in $TEST_BITS; do
+
+rm -rf tests/tmp/*
+
+# Create inputs, spread over a few directories, with some modules found
+# twice (directly and through a symlink) and some which must be skipped.
+MODULE_DIR=tests/tmp/lib/modules/$MODTEST_UNAME
+mkdir -p $MODULE_DIR/kernel/drivers/a $MODULE_DIR/kernel/drivers/b \
+	 $MODULE_DIR/kernel/fs $MODULE_DIR/extra $MODULE_DIR/build \
+	 tests/tmp/serial
+ln tests/data/$BITNESS$ENDIAN/normal/*-$BITNESS.ko $MODULE_DIR/kernel/drivers/a
+ln tests/data/$BITNESS$ENDIAN/complex/*-$BITNESS.ko $MODULE_DIR/kernel/drivers/b
+ln tests/data/$BITNESS$ENDIAN/alias/*-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/modinfo/*-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko \
+   $MODULE_DIR/kernel/fs
+ln tests/data/$BITNESS$ENDIAN/map/*-$BITNESS.ko $MODULE_DIR/extra
+ln tests/data/$BITNESS$ENDIAN/loop/*-$BITNESS.ko $MODULE_DIR/build
+ln -s drivers $MODULE_DIR/kernel/more
+
+[ "`depmod -m -j 1 2>&1`" = "" ]
+mv $MODULE_DIR/modules.* tests/tmp/serial
+# Only the stamp is expected to differ.
+rm tests/tmp/serial/modules.stamp
+
+for JOBS in 2 4 64; do
+    [ "`depmod -m -j $JOBS 2>&1`" = "" ]
+    for f in tests/tmp/serial/*; do
+	cmp $f $MODULE_DIR/`basename $f`
+    done
+    [ "`depmod -n -j $JOBS 2>&1`" = "`depmod -n -j 1 2>&1`" ]
+done
+
+# Bad thread counts
+[ "`depmod -j 0 2>&1`" = "FATAL: -j needs a number of threads" ]
+[ "`depmod -j x 2>&1`" = "FATAL: -j needs a number of threads" ]
+
+done
+done
@@ -0,0 +1,79 @@
+#! /bin/sh
+# Test depmod gives the same output from modules.cache as from the modules.
+
+for ENDIAN in $TEST_ENDIAN; do
+for BITNESS in $TEST_BITS; do
+
+rm -rf tests/tmp/*
+
+# Create inputs
+MODULE_DIR=tests/tmp/lib/modules/$MODTEST_UNAME
+mkdir -p $MODULE_DIR/kernel $MODULE_DIR/extra tests/tmp/cold
+ln tests/data/$BITNESS$ENDIAN/normal/noexport*-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/complex/*-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/alias/*-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/modinfo/*-$BITNESS.ko \
+   $MODULE_DIR/kernel
+ln tests/data/$BITNESS$ENDIAN/map/*-$BITNESS.ko $MODULE_DIR/extra
+# A copy, as it gets written to
+cp tests/data/$BITNESS$ENDIAN/normal/export_dep-$BITNESS.ko $MODULE_DIR/kernel
+
+# Read every module, then compare what we get from the cache
+cold()
+{
+	rm -f tests/tmp/cold/*
+	[ "`depmod -m -R 2>&1`" = "" ]
+	[ -f $MODULE_DIR/modules.cache ]
+	cp $MODULE_DIR/modules.* tests/tmp/cold
+	rm tests/tmp/cold/modules.stamp
+}
+
+same_as_cold()
+{
+	[ "`depmod -m 2>&1`" = "" ]
+	for f in tests/tmp/cold/*; do
+	    cmp $f $MODULE_DIR/`basename $f`
+	done
+	[ "`depmod -n 2>&1`" = "`depmod -n -R 2>&1`" ]
+}
+
+cold
+same_as_cold
+
+# A module replaced in place (same inode, new size) is read again.
+cat tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko \
+    > $MODULE_DIR/kernel/export_dep-$BITNESS.ko
+[ "`depmod -m 2>&1`" = "" ]
+[ `grep -c "^alias symbol:exported3 " $MODULE_DIR/modules.symbols` = 0 ]
+cold
+same_as_cold
+
+# So is one replaced by another file.
+rm $MODULE_DIR/kernel/export_dep-$BITNESS.ko
+ln tests/data/$BITNESS$ENDIAN/normal/export_dep-$BITNESS.ko $MODULE_DIR/kernel
+[ "`depmod -m 2>&1`" = "" ]
+grep -q "^alias symbol:exported3 export_dep_$BITNESS$" $MODULE_DIR/modules.symbols
+cold
+same_as_cold
+
+# A broken cache is ignored.
+head -c 200 tests/tmp/cold/modules.cache > $MODULE_DIR/modules.cache
+same_as_cold
+echo garbage > $MODULE_DIR/modules.cache
+same_as_cold
+
+# Warnings about a module come up every time.
+touch tests/tmp/symvers
+WARNINGS="`depmod -E /symvers 2>&1`"
+[ "$WARNINGS" != "" ]
+[ "`depmod -E /symvers 2>&1`" = "$WARNINGS" ]
+
+# Only a full run writes the cache.
+rm $MODULE_DIR/modules.cache
+[ "`depmod -n 2>&1 >/dev/null`" = "" ]
+[ "`depmod $MODTEST_UNAME /lib/modules/$MODTEST_UNAME/kernel/alias-$BITNESS.ko 2>&1`" = "" ]
+[ ! -f $MODULE_DIR/modules.cache ]
+
+done
+done
@@ -0,0 +1,67 @@
+#! /bin/sh
+# Test depmod -A goes by modules.stamp while it matches the directories.
+
+for ENDIAN in $TEST_ENDIAN; do
+for BITNESS in $TEST_BITS; do
+
+rm -rf tests/tmp/*
+
+# Create inputs
+MODULE_DIR=tests/tmp/lib/modules/$MODTEST_UNAME
+mkdir -p $MODULE_DIR/kernel/sub tests/tmp/spare
+ln tests/data/$BITNESS$ENDIAN/normal/export_dep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/noexport_dep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko \
+   $MODULE_DIR/kernel
+# A copy, as its timestamp gets changed
+cp tests/data/$BITNESS$ENDIAN/normal/noexport_nodep-$BITNESS.ko \
+   $MODULE_DIR/kernel/sub
+
+# Only a full run writes the stamp.
+[ "`depmod -n 2>&1 >/dev/null`" = "" ]
+[ "`depmod $MODTEST_UNAME /lib/modules/$MODTEST_UNAME/kernel/export_nodep-$BITNESS.ko 2>&1`" = "" ]
+[ ! -f $MODULE_DIR/modules.stamp ]
+[ "`depmod 2>&1`" = "" ]
+grep -q "^end 3$" $MODULE_DIR/modules.stamp
+
+# Nothing changed: -A does nothing, even with a module newer than
+# modules.dep, since the stamp says no module came or went.
+touch -d "2038-01-01" $MODULE_DIR/kernel/sub/noexport_nodep-$BITNESS.ko
+cp $MODULE_DIR/modules.dep tests/tmp/spare
+[ "`depmod -A 2>&1`" = "" ]
+cmp $MODULE_DIR/modules.dep tests/tmp/spare/modules.dep
+[ ! -f $MODULE_DIR/modules.dep.temp ]
+
+# Without the stamp (or with a torn one), every module is looked at.
+head -n 3 $MODULE_DIR/modules.stamp > tests/tmp/spare/modules.stamp
+mv tests/tmp/spare/modules.stamp $MODULE_DIR
+rm $MODULE_DIR/modules.symbols
+[ "`depmod -A 2>&1`" = "" ]
+[ -f $MODULE_DIR/modules.symbols ]
+
+rm $MODULE_DIR/modules.stamp $MODULE_DIR/modules.symbols
+[ "`depmod -A 2>&1`" = "" ]
+[ -f $MODULE_DIR/modules.symbols ]
+grep -q "^end 3$" $MODULE_DIR/modules.stamp
+
+# A module removed from a subdirectory: that directory no longer
+# matches, and the old modules.dep isn't kept around.
+touch -d "2000-01-01" $MODULE_DIR/kernel/sub/noexport_nodep-$BITNESS.ko
+[ "`depmod 2>&1`" = "" ]
+mv $MODULE_DIR/kernel/sub/noexport_nodep-$BITNESS.ko tests/tmp/spare
+rm $MODULE_DIR/modules.symbols
+[ "`depmod -A 2>&1`" = "" ]
+[ ! -f $MODULE_DIR/modules.symbols ]
+
+# ...but one added there is noticed.
+[ "`depmod 2>&1`" = "" ]
+rm $MODULE_DIR/modules.symbols
+sleep 1
+mv tests/tmp/spare/noexport_nodep-$BITNESS.ko $MODULE_DIR/kernel/sub
+touch $MODULE_DIR/kernel/sub/noexport_nodep-$BITNESS.ko
+[ "`depmod -A 2>&1`" = "" ]
+[ -f $MODULE_DIR/modules.symbols ]
+grep -q "^kernel/sub/noexport_nodep-$BITNESS.ko:$" $MODULE_DIR/modules.dep
+
+done
+done
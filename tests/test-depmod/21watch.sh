@@ -0,0 +1,60 @@
+#! /bin/sh
+# Test depmod --watch rebuilds as modules come and go.
+
+# Wait a while for a command to succeed
+wait_for()
+{
+	i=0
+	until "$@"; do
+	    i=$(($i + 1))
+	    [ $i -lt 100 ] || return 1
+	    sleep 0.1
+	done
+}
+
+for ENDIAN in $TEST_ENDIAN; do
+for BITNESS in $TEST_BITS; do
+
+rm -rf tests/tmp/*
+
+# Create inputs
+MODULE_DIR=tests/tmp/lib/modules/$MODTEST_UNAME
+mkdir -p $MODULE_DIR/kernel
+ln tests/data/$BITNESS$ENDIAN/normal/export_dep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/noexport_dep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko \
+   $MODULE_DIR/kernel
+
+# It needs the whole tree, and somewhere to write.
+[ "`depmod -W -n 2>&1`" = "FATAL: --watch works on the whole module directory, and needs to write the files" ]
+[ "`depmod -W $MODTEST_UNAME /lib/modules/$MODTEST_UNAME/kernel/export_dep-$BITNESS.ko 2>&1`" = "FATAL: --watch works on the whole module directory, and needs to write the files" ]
+
+depmod -W > tests/tmp/out 2>&1 &
+PID=$!
+trap 'kill $PID 2>/dev/null || true' EXIT
+
+# Built to start with
+wait_for grep -qs "^kernel/export_dep-$BITNESS.ko: kernel/export_nodep-$BITNESS.ko$" $MODULE_DIR/modules.dep
+
+# A module in a new directory
+mkdir $MODULE_DIR/updates
+ln tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko $MODULE_DIR/updates
+wait_for grep -qs "^kernel/export_dep-$BITNESS.ko: updates/export_nodep-$BITNESS.ko$" $MODULE_DIR/modules.dep
+
+# A new module in a directory made before the last rebuild
+ln tests/data/$BITNESS$ENDIAN/normal/noexport_nodep-$BITNESS.ko $MODULE_DIR/updates
+wait_for grep -qs "^updates/noexport_nodep-$BITNESS.ko:$" $MODULE_DIR/modules.dep
+
+# Modules going away
+rm -r $MODULE_DIR/updates
+wait_for grep -qs "^kernel/export_dep-$BITNESS.ko: kernel/export_nodep-$BITNESS.ko$" $MODULE_DIR/modules.dep
+[ `grep -c updates $MODULE_DIR/modules.dep` = 0 ]
+
+# Let any rebuild finish before we go.
+kill $PID
+wait $PID 2>/dev/null || true
+sleep 1
+[ ! -s tests/tmp/out ]
+
+done
+done
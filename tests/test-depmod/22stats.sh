@@ -0,0 +1,41 @@
+#! /bin/sh
+# Test depmod --stats reports what it did.
+
+for ENDIAN in $TEST_ENDIAN; do
+for BITNESS in $TEST_BITS; do
+
+rm -rf tests/tmp/*
+
+# Create inputs
+MODULE_DIR=tests/tmp/lib/modules/$MODTEST_UNAME
+mkdir -p $MODULE_DIR
+ln tests/data/$BITNESS$ENDIAN/normal/export_dep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/noexport_dep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/noexport_nodep-$BITNESS.ko \
+   tests/data/$BITNESS$ENDIAN/normal/noexport_doubledep-$BITNESS.ko \
+   $MODULE_DIR
+
+# Nothing unless asked for.
+[ "`depmod 2>&1`" = "" ]
+
+# Every module read, nothing from the cache
+depmod -S -R 2> tests/tmp/stats
+[ "`grep -vc '^phase name=[a-z0-9.]* calls=[0-9]* wall=[0-9.]* cpu=[0-9.]* bytes=[0-9]*$' tests/tmp/stats`" = 1 ]
+grep -q "^counts modules=5 cached=0 symbols=3 lookups=[1-9][0-9]* loaded=[1-9][0-9]* written=[1-9][0-9]*$" tests/tmp/stats
+grep -q "^phase name=total calls=1 " tests/tmp/stats
+grep -q "^phase name=load calls=5 " tests/tmp/stats
+grep -q "^phase name=modules.dep calls=1 .* bytes=`wc -c < $MODULE_DIR/modules.dep`$" tests/tmp/stats
+
+# All from the cache the second time
+depmod -S 2> tests/tmp/stats
+grep -q "^counts modules=5 cached=5 symbols=3 " tests/tmp/stats
+grep -q "^phase name=load calls=0 " tests/tmp/stats
+
+# Including to stdout
+depmod -S -n 2> tests/tmp/stats > tests/tmp/out
+grep -q "^phase name=modules.symbols calls=1 " tests/tmp/stats
+[ `grep -c "^phase name=modules.dep.bin " tests/tmp/stats` = 0 ]
+
+done
+done
@@ -0,0 +1,36 @@
+#! /bin/sh
+# Loop of three modules: reported in the same order as it always has been.
+
+for ENDIAN in $TEST_ENDIAN; do
+for BITNESS in $TEST_BITS; do
+
+rm -rf tests/tmp/*
+
+# Create inputs.  loop1 needs loop2 needs loop3 needs loop1: make loop3
+# from loop1, and have loop2 need it, by renaming symbols in place.
+MODULE_DIR=tests/tmp/lib/modules/$MODTEST_UNAME
+mkdir -p $MODULE_DIR
+cp tests/data/$BITNESS$ENDIAN/loop/loop1-$BITNESS.ko $MODULE_DIR
+sed 's/from_loop1/from_loop3/g' \
+	< tests/data/$BITNESS$ENDIAN/loop/loop2-$BITNESS.ko \
+	> $MODULE_DIR/loop2-$BITNESS.ko
+sed -e 's/from_loop1/from_loop3/g' -e 's/from_loop2/from_loop1/g' \
+	< tests/data/$BITNESS$ENDIAN/loop/loop1-$BITNESS.ko \
+	> $MODULE_DIR/loop3-$BITNESS.ko
+
+# Expect no normal output.
+[ "`depmod 2>tests/tmp/stderr`" = "" ]
+
+# Check results: expect 0 lines (all have loops).
+[ `grep -vc '^#' < $MODULE_DIR/modules.dep` = 0 ]
+
+# One report of the loop, from loop1, and 3 warnings.
+[ `grep -vc '^#' < tests/tmp/stderr` = 4 ]
+
+for MOD in loop1 loop2 loop3; do
+	[ "`grep -w /lib/modules/$MODTEST_UNAME/$MOD-$BITNESS.ko\ ignored tests/tmp/stderr`" = "WARNING: Module /lib/modules/$MODTEST_UNAME/$MOD-$BITNESS.ko ignored, due to loop" ]
+done
+[ "`grep -w detected tests/tmp/stderr`" = "WARNING: Loop detected: /lib/modules/$MODTEST_UNAME/loop1-$BITNESS.ko needs loop3-$BITNESS.ko needs loop2-$BITNESS.ko which needs loop1-$BITNESS.ko again!" ]
+
+done
+done
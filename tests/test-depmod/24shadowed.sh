@@ -0,0 +1,35 @@
+#! /bin/sh
+# Only the module picked for each name is read.
+
+for ENDIAN in $TEST_ENDIAN; do
+for BITNESS in $TEST_BITS; do
+
+rm -rf tests/tmp/*
+
+# Create inputs: updates/ shadows kernel/
+MODULE_DIR=tests/tmp/lib/modules/$MODTEST_UNAME
+mkdir -p $MODULE_DIR/kernel $MODULE_DIR/updates
+for DIR in kernel updates; do
+	ln tests/data/$BITNESS$ENDIAN/normal/export_dep-$BITNESS.ko \
+	   tests/data/$BITNESS$ENDIAN/normal/export_nodep-$BITNESS.ko \
+	   $MODULE_DIR/$DIR
+done
+touch tests/tmp/symvers
+
+# Warnings come only for the modules in updates/.
+depmod -E /symvers > tests/tmp/out 2>&1
+grep -q "/lib/modules/$MODTEST_UNAME/updates/export_dep-$BITNESS.ko is built without modversions" tests/tmp/out
+grep -q "/lib/modules/$MODTEST_UNAME/updates/export_nodep-$BITNESS.ko is built without modversions" tests/tmp/out
+[ `grep -c kernel/ tests/tmp/out` = 0 ]
+[ "`grep -w export_dep-$BITNESS.ko: $MODULE_DIR/modules.dep`" = "updates/export_dep-$BITNESS.ko: updates/export_nodep-$BITNESS.ko" ]
+
+# One which can't be read gives way to the next of the same name.
+rm $MODULE_DIR/updates/export_nodep-$BITNESS.ko
+echo garbage > $MODULE_DIR/updates/export_nodep-$BITNESS.ko
+depmod > tests/tmp/out 2>&1
+[ "`cat tests/tmp/out`" = "WARNING: Can't read module /lib/modules/$MODTEST_UNAME/updates/export_nodep-$BITNESS.ko: Exec format error" ]
+[ "`grep -w export_dep-$BITNESS.ko: $MODULE_DIR/modules.dep`" = "updates/export_dep-$BITNESS.ko: kernel/export_nodep-$BITNESS.ko" ]
+[ "`grep -w export_nodep-$BITNESS.ko: $MODULE_DIR/modules.dep`" = "kernel/export_nodep-$BITNESS.ko:" ]
+
+done
+done
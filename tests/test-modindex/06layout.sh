@@ -0,0 +1,24 @@
+#! /bin/sh
+
+# Nodes are written in pre-order: the root node follows the header
+
+modindex -o tests/tmp/index << EOF
+ask 1
+ate 2
+on 3
+once 4
+one 5
+EOF
+
+# Third word is the root offset, flags in the high nibble; the fourth
+# and fifth are the offsets of the string table and hash table
+[ "`od -A n -t x1 -j 8 -N 4 tests/tmp/index | tr -d ' '`" = "30000014" ]
+
+[ "`modindex -d tests/tmp/index`" = "ask 1
+ate 2
+on 3
+once 4
+one 5" ]
+
+[ "`modindex -s once tests/tmp/index`" = "Found value:
+4" ]
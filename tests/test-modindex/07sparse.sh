@@ -0,0 +1,35 @@
+#! /bin/sh
+
+# Nodes with few, widely spaced children use sparse child tables
+
+modindex -o tests/tmp/index << EOF
+A 1
+m 2
+z 3
+z[0-9] 4
+z* 5
+~ 6
+EOF
+
+[ "`modindex -d tests/tmp/index`" = "A 1
+m 2
+z 3
+z* 5
+z[0-9] 4
+~ 6" ]
+
+# Sparse root: flags for children and sparse children
+[ "`od -A n -t x1 -j 8 -N 4 tests/tmp/index | tr -d ' '`" = "30000014" ]
+
+[ "`modindex -s A tests/tmp/index`" = "Found value:
+1" ]
+[ "`modindex -s z tests/tmp/index`" = "Found value:
+3" ]
+[ "`modindex -s '~' tests/tmp/index`" = "Found value:
+6" ]
+[ "`modindex -s n tests/tmp/index`" = "Not found." ]
+[ "`modindex -s B tests/tmp/index`" = "Not found." ]
+
+[ "`modindex -w z7 tests/tmp/index`" = "Found value(s):
+4
+5" ]
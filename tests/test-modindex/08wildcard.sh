@@ -0,0 +1,27 @@
+#! /bin/sh
+
+# Wildcard keys are matched while walking the index
+
+modindex -o tests/tmp/index << EOF
+pci:v00008086d*sv*sd*bc02* 1
+pci:v00008086d00001234sv*sd*bc* 2
+pci:v0000*d*sv*sd*bc03* 3
+usb:v[0-9]p[!a]d* 4
+usb:v1p? 5
+usb:v[[:digit:]]p[]x]* 6
+EOF
+
+[ "`modindex -w pci:v00008086d00001234sv0sd0bc02sc00 tests/tmp/index`" = "Found value(s):
+1
+2" ]
+[ "`modindex -w pci:v00001002d00001234sv0sd0bc03sc00 tests/tmp/index`" = "Found value(s):
+3" ]
+[ "`modindex -w pci:v00001002d00001234sv0sd0bc02sc00 tests/tmp/index`" = "Not found." ]
+
+[ "`modindex -w usb:v1pbdx tests/tmp/index`" = "Found value(s):
+4" ]
+[ "`modindex -w usb:v1padx tests/tmp/index`" = "Not found." ]
+[ "`modindex -w usb:v1pz tests/tmp/index`" = "Found value(s):
+5" ]
+[ "`modindex -w usb:v5p]] tests/tmp/index`" = "Found value(s):
+6" ]
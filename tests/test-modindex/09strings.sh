@@ -0,0 +1,23 @@
+#! /bin/sh
+
+# Values are stored once each, in a string table after the nodes
+
+modindex -o tests/tmp/index << EOF
+pci:v00008086d* e1000e
+usb:v0bdap8187* rtl8187
+pci:v00008086d00001234* e1000e
+pci:v00008086d00005678* e1000e
+pnp:dPNP0C0A* battery
+EOF
+
+[ "`tr '\000' '\n' < tests/tmp/index | grep -c e1000e`" = 1 ]
+
+[ "`modindex -d tests/tmp/index`" = "pci:v00008086d* e1000e
+pci:v00008086d00001234* e1000e
+pci:v00008086d00005678* e1000e
+pnp:dPNP0C0A* battery
+usb:v0bdap8187* rtl8187" ]
+
+[ "`modindex -w pci:v00008086d00001234sv0 tests/tmp/index`" = "Found value(s):
+e1000e
+e1000e" ]
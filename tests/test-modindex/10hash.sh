@@ -0,0 +1,32 @@
+#! /bin/sh
+
+# Exact lookups use the hash table, if there is one
+
+modindex -H -o tests/tmp/index << EOF
+ext4 kernel/fs/ext4/ext4.ko: kernel/fs/jbd2/jbd2.ko kernel/lib/crc16.ko
+jbd2 kernel/fs/jbd2/jbd2.ko:
+crc16 kernel/lib/crc16.ko:
+e1000e kernel/drivers/net/e1000e/e1000e.ko:
+EOF
+
+[ "`modindex -s ext4 tests/tmp/index`" = "Found value:
+kernel/fs/ext4/ext4.ko: kernel/fs/jbd2/jbd2.ko kernel/lib/crc16.ko" ]
+[ "`modindex -s crc16 tests/tmp/index`" = "Found value:
+kernel/lib/crc16.ko:" ]
+[ "`modindex -s crc tests/tmp/index`" = "Not found." ]
+[ "`modindex -s ext4x tests/tmp/index`" = "Not found." ]
+[ "`modindex -s '' tests/tmp/index`" = "Not found." ]
+
+# The trie is still there for everything else
+[ "`modindex -d tests/tmp/index`" = "crc16 kernel/lib/crc16.ko:
+e1000e kernel/drivers/net/e1000e/e1000e.ko:
+ext4 kernel/fs/ext4/ext4.ko: kernel/fs/jbd2/jbd2.ko kernel/lib/crc16.ko
+jbd2 kernel/fs/jbd2/jbd2.ko:" ]
+
+# Without the root node, only the hash table can find keys
+printf '\000\000\000\000' | dd of=tests/tmp/index bs=1 seek=8 conv=notrunc 2>/dev/null
+[ "`modindex -d tests/tmp/index`" = "" ]
+[ "`modindex -s jbd2 tests/tmp/index`" = "Found value:
+kernel/fs/jbd2/jbd2.ko:" ]
+[ "`modindex -s e1000e tests/tmp/index`" = "Found value:
+kernel/drivers/net/e1000e/e1000e.ko:" ]
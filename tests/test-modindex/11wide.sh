@@ -0,0 +1,32 @@
+#! /bin/sh
+
+# Indexes too big for 32 bit offsets are written with 64 bit offsets
+
+MODTEST_INDEX_WIDE=1
+export MODTEST_INDEX_WIDE
+
+modindex -H -o tests/tmp/index << EOF
+ask 1
+ate 2
+on 3
+once 4
+one 5
+on* 6
+EOF
+
+# Version 5.0, and the root offset is 64 bits with flags in the high nibble
+[ "`od -A n -t x1 -j 4 -N 4 tests/tmp/index | tr -d ' '`" = "00050000" ]
+[ "`od -A n -t x1 -j 8 -N 8 tests/tmp/index | tr -d ' '`" = "3000000000000020" ]
+
+[ "`modindex -d tests/tmp/index`" = "ask 1
+ate 2
+on 3
+on* 6
+once 4
+one 5" ]
+
+[ "`modindex -s once tests/tmp/index`" = "Found value:
+4" ]
+[ "`modindex -s onc tests/tmp/index`" = "Not found." ]
+[ "`modindex -w onerous tests/tmp/index`" = "Found value(s):
+6" ]
@@ -194,6 +194,21 @@ const char *next_string(const char *string, unsigned long *secsize)
 	return string;
 }
 
+/*
+ * FNV-1a hash of a string, starting from the usual offset basis xored
+ * with seed, so that one string can be given several unrelated hashes.
+ */
+uint32_t fnv_hash(const char *str, uint32_t seed)
+{
+	uint32_t hash = 2166136261U ^ seed;
+
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
 /*
  * Get CPU endianness. 0 = unknown, 1 = ELFDATA2LSB = little, 2 = ELFDATA2MSB = big
  */
@@ -2,6 +2,7 @@
 #define _UTIL_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 struct string_table
 {
@@ -21,6 +22,8 @@ void strtbl_free(struct string_table *tbl);
 
 const char *next_string(const char *string, unsigned long *secsize);
 
+uint32_t fnv_hash(const char *str, uint32_t seed);
+
 /*
  * Change endianness of x if conv is true.
  */